@@ -59,6 +59,7 @@ build.o: $(OBJS)
 %.elf: $(OBJS) %.ld Makefile
 	@echo LD $@
 	$(CC) $(LDFLAGS) -T$(*F).ld $(OBJS) -o $@
+	python3 $(ROOT)/scripts/fwcrc.py $@
 	chmod a-x $@
 
 %.hex: %.elf
@@ -12,18 +12,28 @@
 extern struct packed config {
     char TOStitle[4][17];	// TOS names for each bank
     uint8_t  tos; 		// current TOS bank
-    uint8_t  sound; 		// mono or stereo sound at startup
-    uint8_t  boot; 		// startup with intern floppy or extern floppy
-
-    uint16_t crc16_ccitt;
-
+    uint8_t  sound[4];		// per TOS bank: mono (1) or stereo (0) sound
+    uint8_t  boot[4];		// per TOS bank: boot from intern (1) or extern (0) floppy
+    uint8_t  lcd_cols;		// LCD geometry: 16, 20 or 40 columns
+    uint8_t  lcd_rows;		// LCD geometry: 2 or 4 rows
+    uint8_t  sh1106;		// OLED controller: SSD1306 (0) or SH1106 (1)
 } config;
 
 extern bool_t config_active;
-extern struct display config_display;
 
 void config_init(void);
-void config_process(uint8_t stKey);
+/* @stKey: Atari key from update_st_keys(); @conKey: console key passed on
+ * by shell_process(), or -1. */
+void config_process(uint8_t stKey, int conKey);
+
+/* Options by name, for the console shell. config_get() formats option @i as
+ * "name = value", and fails past the last option. */
+int config_find(const char *name);
+bool_t config_get(unsigned int i, char *buf, unsigned int len);
+bool_t config_set(unsigned int i, const char *val);
+/* Saves run in the background: config_saving() until done. */
+void config_save(void);
+bool_t config_saving(void);
 
 /*
  * Local variables:
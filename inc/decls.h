@@ -21,6 +21,7 @@
 #include "stm32f10x.h"
 
 #include "config.h"
+#include "display.h"
 #include "cancellation.h"
 #include "time.h"
 #include "timer.h"
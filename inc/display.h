@@ -0,0 +1,82 @@
+/*
+ * display.h
+ *
+ * Compose the LCD/OLED contents from prioritised layers.
+ *
+ * Written & released by Frank Beentjes <frankbeen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* Display layers, lowest priority first. A shown layer hides the layers
+ * beneath it on every row it covers. */
+enum {
+    LAYER_BASE = 0, /* FlashFloppy text: always shown */
+    LAYER_STATUS,   /* status bar: bottom row */
+    LAYER_TOAST,    /* notifications: top two rows */
+    LAYER_MENU,     /* config menu: whole display */
+    NR_LAYERS
+};
+
+/* Set row @row of @layer to string @text, padded with spaces. */
+void display_set_row(unsigned int layer, unsigned int row, const char *text);
+
+/* Show @layer for @timeout ticks of 100ms, or until hidden if @timeout is 0. */
+void display_show(unsigned int layer, uint8_t timeout);
+void display_hide(unsigned int layer);
+
+/* Called every 100ms from the timer interrupt. */
+void display_tick(void);
+
+/* Called from the main loop: bring the display up to date. */
+void process_display(void);
+
+/* Custom glyphs for use in the text of the status, notification and menu
+ * layers. On the base layer, codes 0-7 (and 8-15) are FlashFloppy's own
+ * CGRAM glyphs. */
+#define GLYPH_UP    "\x01"
+#define GLYPH_DOWN  "\x02"
+#define GLYPH_RIGHT "\x03"
+#define GLYPH_DISK  "\x04"
+#define GLYPH_RESET "\x05"
+
+/* Show a two-line notification for 3 seconds. */
+void notify(const char *line1, const char *line2);
+
+/* Mirror the display on a VT100 terminal on the serial console? */
+extern bool_t display_mirror;
+
+/* Forget what the display shows, e.g. after it has been reinitialised. */
+void display_invalidate(void);
+
+/* LCD/OLED backend: lcd.c */
+extern uint8_t lcd_cols, lcd_rows;
+extern struct lcd_stats {
+    uint32_t errors;     /* failed I2C transactions */
+    uint32_t recoveries; /* successful bus recoveries */
+    uint16_t bus_khz;    /* negotiated bus speed */
+} lcd_stats;
+bool_t lcd_init(void);
+bool_t lcd_ready(void);
+bool_t lcd_refresh(uint8_t *text, uint8_t ruleNr, uint8_t len);
+/* Start composing a new frame, for the custom glyph cache. */
+void lcd_glyph_frame(void);
+/* Find or allocate a CGRAM slot for 5x8 glyph @bits, and mark it used in the
+ * current frame. Returns the character code (0-7), or -1 if all slots are in
+ * use in this frame. */
+int lcd_glyph(const uint8_t *bits);
+bool_t lcd_shift_left(void);
+bool_t lcd_shift_home(void);
+bool_t isBacklightOn(void);
+void backlight(int on);
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -14,6 +14,7 @@
 #define SCB volatile struct scb * const
 #define NVIC volatile struct nvic * const
 #define FLASH volatile struct flash * const
+#define CRC volatile struct crc * const
 #define PWR volatile struct pwr * const
 #define BKP volatile struct bkp * const
 #define RCC volatile struct rcc * const
@@ -36,6 +37,7 @@ static STK stk = (struct stk *)STK_BASE;
 static SCB scb = (struct scb *)SCB_BASE;
 static NVIC nvic = (struct nvic *)NVIC_BASE;
 static FLASH flash = (struct flash *)FLASH_BASE;
+static CRC crc = (struct crc *)CRC_BASE;
 static PWR pwr = (struct pwr *)PWR_BASE;
 static BKP bkp = (struct bkp *)BKP_BASE;
 static RCC rcc = (struct rcc *)RCC_BASE;
@@ -78,6 +80,11 @@ extern uint32_t vector_table[];
 void stm32_init(void);
 void system_reset(void);
 
+/* The reset cause and any crash record saved by the previous run. Prints
+ * line @n of the report, returning TRUE after the last. */
+bool_t crash_report(unsigned int n);
+void crash_clear(void);
+
 /* Clocks */
 #define SYSCLK_MHZ 72
 #define SYSCLK     (SYSCLK_MHZ * 1000000)
@@ -135,8 +142,33 @@ void fpec_init(void);
 void fpec_page_erase(uint32_t flash_address);
 void fpec_write(const void *data, unsigned int size, uint32_t flash_address);
 
+/* Background Flash jobs: an optional page erase, then programming, run a
+ * step at a time by fpec_process() from the main loop. @data must stay put
+ * until @done is called. */
+struct fpec_job {
+    uint32_t erase;     /* page to erase first, or 0 */
+    uint32_t addr;      /* program @size bytes of @data here */
+    const void *data;
+    unsigned int size;
+    void (*done)(struct fpec_job *job, bool_t ok);
+    /* Private to fpec_process(). */
+    bool_t erased, ok;
+    unsigned int pos;
+};
+void fpec_submit(struct fpec_job *job);
+void fpec_process(void);
+/* Percentage of @job completed. */
+unsigned int fpec_progress(const struct fpec_job *job);
+
 #define FLASH_PAGE_SIZE 1024
 
+/* CRC-32 (poly 0x04c11db7, initial value ~0, no final XOR) of @len bytes at
+ * @buf, word-aligned and a multiple of 4 bytes, computed by the CRC unit.
+ * Words are processed MSB first, as loaded (little endian). Not reentrant. */
+uint32_t crc32(const void *buf, unsigned int len);
+/* Continue the last crc32() over @len more bytes at @buf. */
+uint32_t crc32_more(const void *buf, unsigned int len);
+
 /*
  * Local variables:
  * mode: C
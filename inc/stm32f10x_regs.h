@@ -138,6 +138,17 @@ struct flash {
 
 #define FLASH_BASE 0x40022000
 
+/* CRC calculation unit */
+struct crc {
+    uint32_t dr;       /* 00: Data */
+    uint32_t idr;      /* 04: Independent data */
+    uint32_t cr;       /* 08: Control */
+};
+
+#define CRC_CR_RESET         (1u<< 0)
+
+#define CRC_BASE 0x40023000
+
 /* Power control */
 struct pwr {
     uint32_t cr;       /* 00: Power control */
@@ -155,8 +166,7 @@ struct bkp {
     uint32_t rtccr;    /* 2C: RTC clock calibration */
     uint32_t cr;       /* 30: Control */
     uint32_t csr;      /* 34: Control/status */
-    uint32_t _1[2];    /* 38-3C: - */
-    uint32_t dr2[32];  /* 40-BC: Data block #2 */
+    /* 40-BC: Data block #2 exists only on high-density parts, not ours. */
 };
 
 #define BKP_BASE 0x40006c00
@@ -668,6 +678,8 @@ struct i2c {
 #define I2C_SR2_BUSY      (1u<< 1)
 #define I2C_SR2_MSL       (1u<< 0)
 
+#define I2C_OAR2_ENDUAL   (1u<< 0)
+
 #define I2C_CCR_FS        (1u<<15)
 #define I2C_CCR_DUTY      (1u<<14)
 #define I2C_CCR_CCR(x)    (x)
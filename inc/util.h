@@ -45,11 +45,13 @@ typedef char bool_t;
 void *memset(void *s, int c, size_t n);
 void *memcpy(void *dest, const void *src, size_t n);
 void *memmove(void *dest, const void *src, size_t n);
+int memcmp(const void *s1, const void *s2, size_t n);
 
 size_t strlen(const char *s);
 size_t strnlen(const char *s, size_t maxlen);
 int strcmp(const char *s1, const char *s2);
 int strncmp(const char *s1, const char *s2, size_t n);
+int strcasecmp(const char *s1, const char *s2);
 char *strcpy(char *dest, const char *src);
 char *strrchr(const char *s, int c);
 int tolower(int c);
@@ -71,6 +73,16 @@ int vprintk(const char *format, va_list ap)
 int printk(const char *format, ...)
     __attribute__ ((format (printf, 1, 2)));
 
+/* Deferred-format logging for hot paths. Only the format string's address,
+ * a timestamp and up to 4 integer arguments are logged: the host formats the
+ * message, using scripts/logdecode.py and the firmware ELF. */
+#define LOGK_MAX_ARGS 4
+void logk_record(const char *format, unsigned int nr, const uint32_t *args);
+#define logk(f, a...) do {                                      \
+    const uint32_t __logk_args[] = { 0, ##a };                  \
+    logk_record(f, ARRAY_SIZE(__logk_args) - 1, &__logk_args[1]); \
+} while (0)
+
 #if !defined(NDEBUG)
 #define dprintk(f, a...) printk(f, ##a)
 #else
@@ -132,11 +144,44 @@ extern uint8_t display_type;
 void console_init(void);
 void console_sync(void);
 void console_barrier(void);
+/* Console input: returns the next character or CONSOLE_KEY_* code, or -1 if
+ * there is none. Never blocks. */
+int console_getkey(void);
+#define CONSOLE_KEY_UP    0x100
+#define CONSOLE_KEY_DOWN  0x101
+#define CONSOLE_KEY_RIGHT 0x102
+#define CONSOLE_KEY_LEFT  0x103
+/* Bytes of console output lost because the ring was full. */
+unsigned int console_dropped(void);
+/* Bytes of console input lost because the main loop didn't keep up. */
+unsigned int console_rx_lost(void);
+/* Free space in the console output ring. */
+unsigned int console_space(void);
+/* Console rate, and RTS/CTS flow control. console_baud_actual() returns the
+ * rate we would really get, or 0 if @rate can't be done. The rate should only
+ * be changed when console_tx_idle(). */
+bool_t console_tx_idle(void);
+unsigned int console_baud_actual(unsigned int rate);
+void console_set_baud(unsigned int rate, bool_t flow);
+unsigned int console_get_baud(bool_t *flow);
+
+/* Console command shell. shell_process() returns console keys which are not
+ * for the shell (arrow keys, and all keys while the config menu is active),
+ * or -1. */
+void shell_init(void);
+int shell_process(void);
+
+/* Main loop timing. */
+extern struct loop_stats {
+    uint32_t passes;
+    uint32_t max_us; /* longest pass */
+} loop_stats;
 
 struct display {
     int rows, cols, on;
     uint8_t heights;
     uint8_t text[4][40];
+    uint8_t cgram[8][8]; /* custom glyphs 0-7: 5x8, bit 4 leftmost */
 };
 
 /* LCD / FF-OSD I2C Protocol. */
@@ -145,17 +190,30 @@ void i2c_process(void);
 extern struct display i2c_display;
 extern bool_t i2c_osd_protocol;
 extern uint8_t i2c_buttons_rx; /* Gotek -> FF_OSD */
+struct packed i2c_osd_st_state {
+    uint8_t tos_bank;     /* 0-3 */
+    uint8_t flags;        /* OSD_ST_* */
+    uint8_t kbd_mods;     /* ST_SHIFT | ST_CTRL | ST_ALT */
+    uint16_t reset_count; /* ST resets since power on */
+};
+#define OSD_ST_STEREO   (1u<<0) /* stereo (vs mono) sound */
+#define OSD_ST_BOOT_INT (1u<<1) /* boot from internal (vs external) drive */
 extern struct packed i2c_osd_info {
     uint8_t protocol_ver;
     uint8_t fw_major, fw_minor;
     uint8_t buttons;
+    /* Protocol v2 and later: ST machine state. */
+    struct i2c_osd_st_state st;
+    uint16_t event_seq;   /* incremented on every change to st */
 } i2c_osd_info;
+void i2c_osd_update_st(const struct i2c_osd_st_state *st);
 
 /* Build info. */
 extern const char fw_ver[];
 
 /* Text/data/BSS address ranges. */
 extern char _stext[], _etext[];
+extern const uint32_t _fw_crc[];
 extern char _sdat[], _edat[], _ldat[];
 extern char _sbss[], _ebss[];
 
@@ -167,6 +225,7 @@ extern uint32_t _irq_stacktop[], _irq_stackbottom[];
 #define SYNC_IRQ_PRI          2
 #define I2C_IRQ_PRI           4
 #define AMIKBD_IRQ_PRI        5
+#define LCD_IRQ_PRI           6
 #define TIMER_IRQ_PRI         8
 #define CONSOLE_IRQ_PRI      14
 
@@ -0,0 +1,83 @@
+# fwcrc.py
+#
+# Embed the firmware CRC in a linked ELF: compute the CRC-32 of _stext up to
+# _fw_crc followed by the initialised data (_sdat.._edat, loaded from _ldat),
+# as the STM32 CRC unit does (see crc32() in src/stm32f10x.c), and store it
+# at _fw_crc for the self-check at boot.
+#
+# Usage: python3 scripts/fwcrc.py src/MegaST.elf
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import struct, sys
+
+# STM32 CRC unit: polynomial 0x04c11db7, initial value ~0, each 32-bit word
+# (loaded little endian) shifted in MSB first, no final XOR.
+def stm32_crc32(data):
+    crc = 0xffffffff
+    for w, in struct.iter_unpack('<I', data):
+        crc ^= w
+        for _ in range(32):
+            crc = ((crc << 1) ^ 0x04c11db7) if crc & (1 << 31) else crc << 1
+            crc &= 0xffffffff
+    return crc
+
+def sections(elf):
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', elf, 0x2e)
+    return [struct.unpack_from('<10I', elf, shoff + i*shentsize)
+            for i in range(shnum)]
+
+def symbols(elf, shdrs):
+    syms = {}
+    for sh in shdrs:
+        if sh[1] != 2: # SHT_SYMTAB
+            continue
+        strtab = shdrs[sh[6]]
+        for off in range(sh[4], sh[4] + sh[5], 16):
+            name, value = struct.unpack_from('<II', elf, off)
+            start = strtab[4] + name
+            end = elf.index(b'\0', start)
+            syms[elf[start:end].decode()] = value
+    return syms
+
+# File offset of virtual address @addr, within a PROGBITS section.
+def file_offset(shdrs, addr):
+    for sh in shdrs:
+        if sh[1] == 1 and sh[3] <= addr < sh[3] + sh[5]:
+            return sh[4] + addr - sh[3]
+    raise ValueError('address %08x is not in the image' % addr)
+
+def main(argv):
+    if len(argv) != 2:
+        print('Usage: %s <firmware.elf>' % argv[0], file=sys.stderr)
+        return 1
+    with open(argv[1], 'rb') as f:
+        elf = bytearray(f.read())
+    if elf[:4] != b'\x7fELF' or elf[4] != 1 or elf[5] != 1:
+        print('%s: not a 32-bit little-endian ELF' % argv[1], file=sys.stderr)
+        return 1
+    shdrs = sections(elf)
+    syms = symbols(elf, shdrs)
+    start, end = syms['_stext'], syms['_fw_crc']
+    off = file_offset(shdrs, start)
+    if file_offset(shdrs, end) != off + end - start:
+        print('%s: _stext.._fw_crc is not contiguous' % argv[1],
+              file=sys.stderr)
+        return 1
+    data = elf[off:off + end - start]
+    # .data is in the ELF at its RAM address, and in Flash at _ldat.
+    sdat, edat = syms['_sdat'], syms['_edat']
+    if edat != sdat:
+        doff = file_offset(shdrs, sdat)
+        data += elf[doff:doff + edat - sdat]
+    crc = stm32_crc32(data)
+    struct.pack_into('<I', elf, off + end - start, crc)
+    with open(argv[1], 'wb') as f:
+        f.write(elf)
+    print('Firmware CRC32: %08x (%u bytes)' % (crc, len(data)))
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
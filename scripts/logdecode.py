@@ -0,0 +1,113 @@
+# logdecode.py
+#
+# Decode the MegaST serial console: plain text is passed through, and
+# deferred-format log records (see logk() in inc/util.h) are formatted using
+# the format strings in the firmware ELF.
+#
+# Usage:
+#  stty -F /dev/ttyUSB0 115200 raw
+#  python3 scripts/logdecode.py src/MegaST.elf </dev/ttyUSB0
+#
+# This is free and unencumbered software released into the public domain.
+# See the file COPYING for more details, or visit <http://unlicense.org>.
+
+import re, struct, sys
+
+LOGK_MARKER = 0xf8
+LOGK_MAX_ARGS = 4
+STK_MHZ = 9
+STK_MASK = (1 << 24) - 1
+
+# Memory image of the ELF's allocated sections: list of (addr, bytes).
+def load_elf(name):
+    with open(name, 'rb') as f:
+        elf = f.read()
+    if elf[:4] != b'\x7fELF' or elf[4] != 1 or elf[5] != 1:
+        raise ValueError('%s: not a 32-bit little-endian ELF' % name)
+    shoff, = struct.unpack_from('<I', elf, 0x20)
+    shentsize, shnum = struct.unpack_from('<HH', elf, 0x2e)
+    image = []
+    for i in range(shnum):
+        (_, sh_type, sh_flags, sh_addr, sh_offset,
+         sh_size) = struct.unpack_from('<6I', elf, shoff + i*shentsize)
+        # SHF_ALLOC, and not SHT_NOBITS (.bss)
+        if (sh_flags & 2) and sh_type != 8 and sh_size:
+            image.append((sh_addr, elf[sh_offset:sh_offset+sh_size]))
+    return image
+
+def read_string(image, addr):
+    for base, data in image:
+        if base <= addr < base + len(data):
+            end = data.find(b'\0', addr - base)
+            if end < 0:
+                end = len(data)
+            return data[addr-base:end].decode('latin-1')
+    return None
+
+conv_re = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d+))?(?:hh|h|ll|l|z)?([diuxXcsp%])')
+
+# Format a C printf string with integer arguments, as vsnprintf() would.
+def format_c(image, fmt, args):
+    args = list(args)
+    def conv(m):
+        flags, width, prec, c = m.groups()
+        if c == '%':
+            return '%'
+        a = args.pop(0) if args else 0
+        if c in 'di':
+            a = a - (1 << 32) if a & (1 << 31) else a
+        elif c == 'u':
+            c = 'd'
+        elif c == 'p':
+            flags, width, c = '#', '', 'x'
+        elif c == 's':
+            s = read_string(image, a)
+            a = s if s is not None else '<%08x>' % a
+        elif c == 'c':
+            a = chr(a & 0xff)
+        spec = '%' + flags + width + ('.' + prec if prec else '') + c
+        return spec % a
+    return conv_re.sub(conv, fmt)
+
+def main(argv):
+    if len(argv) != 2:
+        print('Usage: %s <firmware.elf>  <serial-stream' % argv[0],
+              file=sys.stderr)
+        return 1
+    image = load_elf(argv[1])
+    inp = sys.stdin.buffer
+    out = sys.stdout
+    prev = None
+    while True:
+        b = inp.read(1)
+        if not b:
+            break
+        b = b[0]
+        nr = b - LOGK_MARKER
+        if not 0 <= nr <= LOGK_MAX_ARGS:
+            out.write(chr(b))
+            if b == 0x0a:
+                out.flush()
+            continue
+        rec = inp.read((2 + nr) * 4)
+        if len(rec) < (2 + nr) * 4:
+            break
+        w = struct.unpack('<%dI' % (2 + nr), rec)
+        # SysTick counts down and wraps every 1.86s: we can only report the
+        # time since the previous record, modulo the wrap.
+        stamp = '[%10s] ' % ''
+        if prev is not None:
+            delta = ((prev - w[1]) & STK_MASK) / STK_MHZ / 1000
+            stamp = '[+%8.3fms] ' % delta
+        prev = w[1]
+        fmt = read_string(image, w[0])
+        if fmt is None:
+            msg = '<bad format address %08x>\n' % w[0]
+        else:
+            msg = format_c(image, fmt, w[2:])
+        out.write(stamp + msg)
+        out.flush()
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
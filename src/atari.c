@@ -23,6 +23,10 @@
 
 uint8_t stKeyboardState = 0; // keep track on the left Control and Alternate keys
 
+/* keyboard statistics */
+uint32_t stKeyBytes = 0;    // bytes received from the keyboard
+uint32_t stKeyOverruns = 0; // bytes lost because we didn't read them in time
+
 uint8_t keyscan_to_ascii(uint8_t key);
 
 void st_init(void)
@@ -41,11 +45,15 @@ void st_init(void)
 uint8_t st_check(void) 
 {
     uint8_t key;
+    uint16_t sr = usart2->sr;
     
     // Check if RXNE (Read data register not empty) is set
-    if(usart2->sr & USART_SR_RXNE) {
+    if(sr & USART_SR_RXNE) {
     
+        if(sr & USART_SR_ORE)
+            stKeyOverruns++;
         key = usart2->dr;
+        stKeyBytes++;
         
 //        printk("atari code: %u \n", key);
 //        printk("ascii code: %u \n\n", keyscan_to_ascii(key);
@@ -124,6 +132,11 @@ uint8_t getFFbuttons(void)
     return b;
 }
 
+uint8_t getKeyboardModifiers(void)
+{
+    return stKeyboardState & (ST_SHIFT|ST_CTRL|ST_ALT);
+}
+
 uint8_t getConfigButtons(void) 
 {
     return stKeyboardState >> 4;
@@ -12,11 +12,79 @@
 #define F(x) (x-1)
 #define U(x) (1u<<x)
 
-const static struct config *flash_config = (struct config *)0x0800fc00;
+/*
+ * The config is saved as a journal of records across the last CONFIG_PAGES
+ * pages of Flash. A save appends a record after the last one in the current
+ * page, and a page is erased only when the journal moves on to it, so most
+ * saves program a few dozen halfwords and erase nothing. At boot the valid
+ * record with the highest sequence number wins.
+ *
+ * A save is atomic: the commit word is programmed last, and a record without
+ * it is ignored. The page holding the newest record is never erased, so
+ * losing power at any point of a save leaves the previous config intact.
+ *
+ * A record holds the settings as tag-length-value fields (config_fields[]):
+ * settings missing from a record keep their defaults, and fields unknown to
+ * this firmware are skipped. Adding a setting needs only a new tag.
+ */
+#define CONFIG_PAGES 4
+#define CONFIG_BASE  (0x08010000 - CONFIG_PAGES*FLASH_PAGE_SIZE)
+
+/* Bump if the meaning of a saved field changes, and convert records of the
+ * older version in config_migrate(). */
+#define CONFIG_VERSION 1
+
+struct packed aligned(4) config_record {
+    uint32_t crc32;   /* crc32() of len..commit, with commit 0 */
+    uint16_t len;     /* of data[], a multiple of 4; 0xffff: never written */
+    uint16_t seq;
+    uint32_t version; /* CONFIG_VERSION of the firmware that saved it */
+    uint8_t data[];   /* fields: tag, length, value; padded with TAG_END */
+    /* uint32_t commit: 0 when the record is complete */
+};
+
+#define REC_SIZE(len) (sizeof(struct config_record) + (len) + 4)
+#define REC_MAX 256
+#define TAG_END 0xff
+
+#define rec_commit(rec) (*(const uint32_t *)&(rec)->data[(rec)->len])
+
+/* Saved settings. Never reuse a tag for something else: retire it to an
+ * F_fill field if the setting becomes per TOS bank. */
+const static struct config_field {
+    uint8_t tag, offset, size;
+    enum {
+        F_val,  /* saved as is */
+        F_str,  /* saved without the terminating NUL */
+        F_fill  /* not saved: a single byte fills the whole field */
+    } type;
+} config_fields[] = {
+#define FIELD(t, f) { t, offsetof(struct config, f), sizeof(config.f), F_val }
+#define STRING(t, f) { t, offsetof(struct config, f), sizeof(config.f), F_str }
+#define FILL(t, f) { t, offsetof(struct config, f), sizeof(config.f), F_fill }
+    STRING(1, TOStitle[0]),
+    STRING(2, TOStitle[1]),
+    STRING(3, TOStitle[2]),
+    STRING(4, TOStitle[3]),
+    FIELD(5, tos),
+    FILL(6, sound),  /* before per-bank profiles */
+    FILL(7, boot),
+    FIELD(8, lcd_cols),
+    FIELD(9, lcd_rows),
+    FIELD(10, sh1106),
+    FIELD(11, sound),
+    FIELD(12, boot),
+#undef FIELD
+#undef STRING
+#undef FILL
+};
+
+/* The newest valid record (NULL if none), and its sequence number. */
+static const struct config_record *journal_head;
+static uint16_t journal_seq;
 
 #include "default_config.c"
 
-extern void backlight(int on);
 extern void hdLedOff(void);
 extern uint8_t getConfigButtons(void);
 extern uint8_t keyscan_to_ascii(uint8_t key);
@@ -29,44 +97,482 @@ struct config config;
 #define ST_RIGHT 77
 
 
-static void config_printk(const struct config *conf)
+static unsigned int config_encode(const struct config *conf, uint8_t *p)
 {
-    printk("\nCurrent config:\n");
+    const struct config_field *f;
+    const uint8_t *v;
+    unsigned int n, len = 0;
 
-    printk(" TOS names: \n");
-    
-    for(uint8_t i = 0 ; i < 4 ; i++) {
-    	printk("  F%u: %s\n", i+1, conf->TOStitle[i]);
+    for (f = config_fields; f != &config_fields[ARRAY_SIZE(config_fields)];
+         f++) {
+        if (f->type == F_fill)
+            continue;
+        v = (const uint8_t *)conf + f->offset;
+        n = (f->type == F_str)
+            ? strnlen((const char *)v, f->size - 1) : f->size;
+        p[len++] = f->tag;
+        p[len++] = n;
+        memcpy(&p[len], v, n);
+        len += n;
     }
-    
-    printk(" Startup TOS: %u\n", conf->tos);
-    printk(" Startup sound: %s\n",
-           config.sound ? "Mono" : "Stereo");
-    printk(" Startup boot from: %s floppydrive\n",
-           config.boot ? "intern" : "extern");
+    while (len & 3)
+        p[len++] = TAG_END;
+
+    return len;
+}
+
+/* Convert settings saved by firmware of CONFIG_VERSION @version. */
+static void config_migrate(struct config *conf, uint32_t version)
+{
+    switch (version) {
+    /* case N: convert the fields changed in version N+1; fall through. */
+    case CONFIG_VERSION:
+        break;
+    default:
+        /* Newer firmware: keep what makes sense here (config_check()). */
+        printk("Config saved by newer firmware (v%u)\n", version);
+        break;
+    }
+}
+
+static void config_decode(struct config *conf, uint32_t version,
+                          const uint8_t *p, unsigned int len)
+{
+    const uint8_t *end = p + len;
+    const struct config_field *f;
+    uint8_t *v;
+    unsigned int n;
+
+    *conf = dfl_config;
+
+    while (((end - p) >= 2) && (p[0] != TAG_END)
+           && ((n = p[1]) <= (end - p - 2))) {
+        for (f = config_fields;
+             f != &config_fields[ARRAY_SIZE(config_fields)]; f++) {
+            if (f->tag != p[0])
+                continue;
+            v = (uint8_t *)conf + f->offset;
+            if ((f->type == F_str) && (n < f->size)) {
+                memcpy(v, &p[2], n);
+                v[n] = '\0';
+            } else if ((f->type == F_val) && (n == f->size)) {
+                memcpy(v, &p[2], n);
+            } else if ((f->type == F_fill) && (n == 1)) {
+                memset(v, p[2], f->size);
+            }
+            break;
+        }
+        p += 2 + n;
+    }
+
+    config_migrate(conf, version);
 }
 
+static bool_t is_blank(const void *p, unsigned int size)
+{
+    const uint16_t *q = p;
+    for (; size != 0; size -= 2)
+        if (*q++ != 0xffff)
+            return FALSE;
+    return TRUE;
+}
+
+static uint32_t journal_addr(unsigned int pg, unsigned int off)
+{
+    return CONFIG_BASE + pg*FLASH_PAGE_SIZE + off;
+}
+
+/*
+ * Firmware up to v1.9 kept a bare struct in the last page: the titles, tos,
+ * sound and boot, with a big-endian CRC-16 at the end.
+ */
+#define LEGACY_SIZE (4*17+3)
+
+static bool_t config_legacy(struct config *conf)
+{
+    const uint8_t *p = (const uint8_t *)0x0800fc00;
+
+    if (crc16_ccitt(p, LEGACY_SIZE+2, 0xffff))
+        return FALSE;
+
+    *conf = dfl_config;
+    memcpy(conf->TOStitle, p, sizeof(conf->TOStitle));
+    p += sizeof(conf->TOStitle);
+    conf->tos = *p++;
+    memset(conf->sound, *p++, sizeof(conf->sound));
+    memset(conf->boot, *p++, sizeof(conf->boot));
+    return TRUE;
+}
+
+/* The record at @off in page @pg, or NULL if no record starts there. */
+static const struct config_record *journal_at(unsigned int pg,
+                                              unsigned int off)
+{
+    const struct config_record *rec =
+        (const struct config_record *)journal_addr(pg, off);
+
+    if (((off + REC_SIZE(0)) > FLASH_PAGE_SIZE) || (rec->len & 3)
+        || ((off + REC_SIZE(rec->len)) > FLASH_PAGE_SIZE))
+        return NULL;
+    return rec;
+}
+
+/* Offset just past the last record in page @pg. */
+static unsigned int journal_end(unsigned int pg)
+{
+    const struct config_record *rec;
+    unsigned int off = 0;
+
+    while ((rec = journal_at(pg, off)) != NULL)
+        off += REC_SIZE(rec->len);
+    return off;
+}
+
+static uint32_t rec_crc(const struct config_record *rec)
+{
+    return crc32(&rec->len, REC_SIZE(rec->len) - 4);
+}
+
+/* Only for committed records: commit must be 0. */
+static bool_t rec_crc_ok(const struct config_record *rec)
+{
+    return rec_crc(rec) == rec->crc32;
+}
+
+/* Find the newest committed record, checking CRCs only if @check. */
+static void journal_find(bool_t check)
+{
+    const struct config_record *rec;
+    unsigned int pg, off;
+
+    journal_head = NULL;
+    for (pg = 0; pg < CONFIG_PAGES; pg++) {
+        for (off = 0; (rec = journal_at(pg, off)) != NULL;
+             off += REC_SIZE(rec->len)) {
+            if ((rec_commit(rec) != 0) || (check && !rec_crc_ok(rec)))
+                continue;
+            /* Sequence numbers in the journal span far less than 2^15. */
+            if (!journal_head || ((int16_t)(rec->seq - journal_seq) > 0)) {
+                journal_head = rec;
+                journal_seq = rec->seq;
+            }
+        }
+    }
+}
+
+static void journal_scan(void)
+{
+    /* The newest committed record is good unless Flash has gone bad: then
+     * it's worth checking every record's CRC to find a good one. */
+    journal_find(FALSE);
+    if (journal_head && !rec_crc_ok(journal_head))
+        journal_find(TRUE);
+}
+
+/* Save in progress: the record being written, and where. */
+static uint32_t save_buf[REC_MAX/4];
+static struct fpec_job save_job;
+static const struct config_record *save_at;
+static struct config *save_again;
+static bool_t save_busy, save_reboot;
+
+static void config_write_flash(struct config *conf);
+
+static void config_saved(struct fpec_job *job, bool_t ok)
+{
+    struct config *conf = save_again;
+
+    save_busy = FALSE;
+    if (ok && (rec_commit(save_at) == 0) && rec_crc_ok(save_at)) {
+        journal_head = save_at;
+        journal_seq = save_at->seq;
+    } else {
+        printk("Config save failed\n");
+    }
+
+    /* The config changed while we were saving it. */
+    save_again = NULL;
+    if (conf)
+        config_write_flash(conf);
+    else if (save_reboot)
+        while(1) {} /* hang and let WDT reboot */
+}
+
+/* Start saving @conf in the background: see fpec_process(). */
 static void config_write_flash(struct config *conf)
 {
-    conf->crc16_ccitt = htobe16(
-        crc16_ccitt(conf, sizeof(*conf)-2, 0xffff));
-    fpec_init();
-    fpec_page_erase((uint32_t)flash_config);
-    fpec_write(conf, sizeof(*conf), (uint32_t)flash_config);
+    struct config_record *rec = (struct config_record *)save_buf;
+    unsigned int pg, off, size;
+
+    if (save_busy) {
+        save_again = conf;
+        return;
+    }
+
+    rec->len = config_encode(conf, rec->data);
+    rec->seq = journal_seq + 1;
+    rec->version = CONFIG_VERSION;
+    size = REC_SIZE(rec->len);
+    ASSERT(size <= sizeof(save_buf));
+    *(uint32_t *)&rec->data[rec->len] = 0;
+    rec->crc32 = rec_crc(rec);
+
+    /* Append to the newest record's page if there's room. Otherwise move on
+     * to the next page, erasing it first if needed. */
+    pg = journal_head
+        ? ((uint32_t)journal_head - CONFIG_BASE) / FLASH_PAGE_SIZE : 0;
+    off = journal_end(pg);
+    save_job.erase = 0;
+    if (((off + size) > FLASH_PAGE_SIZE)
+        || !is_blank((void *)journal_addr(pg, off), size)) {
+        pg = (pg + 1) % CONFIG_PAGES;
+        off = 0;
+        if (!is_blank((void *)journal_addr(pg, 0), FLASH_PAGE_SIZE))
+            save_job.erase = journal_addr(pg, 0);
+    }
+
+    save_at = (const struct config_record *)journal_addr(pg, off);
+    save_job.addr = journal_addr(pg, off);
+    save_job.data = rec;
+    save_job.size = size;
+    save_job.done = config_saved;
+    save_busy = TRUE;
+    fpec_submit(&save_job);
+}
+
+bool_t config_saving(void)
+{
+    return save_busy;
+}
+
+/* Supported LCD geometries (columns x rows). */
+const static struct lcd_geometry {
+    uint8_t cols, rows;
+} lcd_geometries[] = {
+    { 16, 2 }, { 20, 2 }, { 20, 4 }, { 40, 2 }
+};
+
+static unsigned int lcd_get(void)
+{
+    unsigned int i;
+    for (i = 0; i < ARRAY_SIZE(lcd_geometries); i++)
+        if ((lcd_geometries[i].cols == config.lcd_cols)
+            && (lcd_geometries[i].rows == config.lcd_rows))
+            return i;
+    return 0;
+}
+
+static void lcd_set(unsigned int i)
+{
+    config.lcd_cols = lcd_geometries[i].cols;
+    config.lcd_rows = lcd_geometries[i].rows;
+}
+
+/* What to do on leaving the menu. */
+enum { C_SAVE = 0, C_SAVEREBOOT, C_USE, C_DISCARD, C_RESET, C_NC_MAX };
+static unsigned int new_config;
+
+/*
+ * The config menu, and the options of the console shell, in menu order.
+ * MI_text edits a string by typing; MI_range steps a number between @min and
+ * @max; MI_enum and MI_action cycle through @values. A setting with @get and
+ * @set hooks is not a plain uint8_t in struct config.
+ */
+const static struct menu_item {
+    enum { MI_text, MI_range, MI_enum, MI_action } type;
+    const char *name;  /* for the shell */
+    const char *label; /* menu prompt */
+    void *p;
+    uint8_t min, max;
+    const char *const *values;
+    unsigned int (*get)(void);
+    void (*set)(unsigned int);
+} menu_items[] = {
+#define TEXT(n, l, f) { MI_text, n, l, config.f, 0, sizeof(config.f)-1 }
+#define RANGE(n, l, f, lo, hi) { MI_range, n, l, &config.f, lo, hi }
+#define ENUM(n, l, f, ...) {                                    \
+        MI_enum, n, l, &config.f, 0,                            \
+        ARRAY_SIZE(((const char *[]){ __VA_ARGS__ }))-1,        \
+        (const char *const []){ __VA_ARGS__ } }
+#define BANK(i)                                                 \
+    TEXT("title" #i, "ROM " #i " name:", TOStitle[i-1]),        \
+    ENUM("sound" #i, "ROM " #i " sound:", sound[i-1],           \
+         "Stereo", "Mono"),                                     \
+    ENUM("boot" #i, "ROM " #i " boot:", boot[i-1],              \
+         "Extern", "Intern")
+    BANK(1), BANK(2), BANK(3), BANK(4),
+    RANGE("tos", "TOS rom (1-4):", tos, 1, 4),
+    { MI_enum, "lcd", "LCD (on reset):", NULL,
+      0, ARRAY_SIZE(lcd_geometries)-1,
+      (const char *const []){ "16x2", "20x2", "20x4", "40x2" },
+      lcd_get, lcd_set },
+    ENUM("oled", "OLED type:", sh1106, "SSD1306", "SH1106"),
+    { MI_action, NULL, "Save new Config?", &new_config, 0, C_NC_MAX-1,
+      (const char *const []){ "Save", "Save+Reset", "Use",
+              "Discard", "Factory Reset" } },
+#undef TEXT
+#undef RANGE
+#undef ENUM
+#undef BANK
+};
+
+static unsigned int item_get(const struct menu_item *m)
+{
+    if (m->get)
+        return (*m->get)();
+    return (m->type == MI_action) ? *(unsigned int *)m->p : *(uint8_t *)m->p;
+}
+
+static void item_set(const struct menu_item *m, unsigned int v)
+{
+    if (m->set)
+        (*m->set)(v);
+    else if (m->type == MI_action)
+        *(unsigned int *)m->p = v;
+    else
+        *(uint8_t *)m->p = v;
+}
+
+static void item_format(const struct menu_item *m, char *buf, unsigned int len)
+{
+    switch (m->type) {
+    case MI_text:
+        snprintf(buf, len, "%s", (char *)m->p);
+        break;
+    case MI_range:
+        snprintf(buf, len, "%u", item_get(m));
+        break;
+    default:
+        snprintf(buf, len, "%s", m->values[item_get(m)]);
+        break;
+    }
+}
+
+static bool_t item_parse(const struct menu_item *m, const char *val)
+{
+    unsigned int i;
+    char *p;
+    long n;
+
+    switch (m->type) {
+    case MI_text:
+        if (strlen(val) > m->max)
+            return FALSE;
+        strcpy(m->p, val);
+        return TRUE;
+    case MI_range:
+        n = strtol(val, &p, 10);
+        if (*p || (n < m->min) || (n > m->max))
+            return FALSE;
+        item_set(m, n);
+        return TRUE;
+    default:
+        for (i = m->min; i <= m->max; i++) {
+            if (!strcasecmp(m->values[i], val)) {
+                item_set(m, i);
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+}
+
+/* Settings are the items before the exit action. */
+#define NR_SETTINGS (ARRAY_SIZE(menu_items) - 1)
+
+/* Reset settings which the menu can't show, e.g. as saved by other firmware,
+ * to their defaults. */
+static void config_check(struct config *conf)
+{
+    const struct menu_item *m;
+    unsigned int i, off;
+    uint8_t *v;
+
+    for (m = menu_items; m != &menu_items[NR_SETTINGS]; m++) {
+        if (!m->p)
+            continue;
+        off = (uint8_t *)m->p - (uint8_t *)&config;
+        v = (uint8_t *)conf + off;
+        if (m->type == MI_text)
+            v[m->max] = '\0';
+        else if ((*v < m->min) || (*v > m->max))
+            *v = ((const uint8_t *)&dfl_config)[off];
+    }
+
+    for (i = 0; i < ARRAY_SIZE(lcd_geometries); i++)
+        if ((lcd_geometries[i].cols == conf->lcd_cols)
+            && (lcd_geometries[i].rows == conf->lcd_rows))
+            break;
+    if (i == ARRAY_SIZE(lcd_geometries)) {
+        conf->lcd_cols = dfl_config.lcd_cols;
+        conf->lcd_rows = dfl_config.lcd_rows;
+    }
+}
+
+int config_find(const char *name)
+{
+    unsigned int i;
+    for (i = 0; i < NR_SETTINGS; i++)
+        if (!strcmp(menu_items[i].name, name))
+            return i;
+    return -1;
+}
+
+bool_t config_get(unsigned int i, char *buf, unsigned int len)
+{
+    unsigned int n;
+
+    if (i >= NR_SETTINGS)
+        return FALSE;
+    n = snprintf(buf, len, "%s = ", menu_items[i].name);
+    if (n < len)
+        item_format(&menu_items[i], buf + n, len - n);
+    return TRUE;
+}
+
+bool_t config_set(unsigned int i, const char *val)
+{
+    return (i < NR_SETTINGS) && item_parse(&menu_items[i], val);
+}
+
+static void config_printk(void)
+{
+    char s[40];
+    unsigned int i;
+
+    printk("\nCurrent config:\n");
+    for (i = 0; config_get(i, s, sizeof(s)); i++)
+        printk(" %s\n", s);
+}
+
+void config_save(void)
+{
+    config_write_flash(&config);
 }
 
 void config_init(void)
 {
-    uint16_t crc;
+    bool_t ok;
 
     printk("\n** Atari STe Xtreme v%s **\n", fw_ver);
     printk("** Frank Beentjes <frankbeen@gmail.com>\n");
     printk("** Special thanks goes to: Keir Fraser\n");
     printk("** https://github.com/fbeen/stextreme\n");
 
-    config = *flash_config;
-    crc = crc16_ccitt(&config, sizeof(config), 0xffff);
-    if (crc) {
+    journal_scan();
+    ok = TRUE;
+    if (journal_head) {
+        config_decode(&config, journal_head->version,
+                      journal_head->data, journal_head->len);
+        config_check(&config);
+    } else if (config_legacy(&config)) {
+        /* Migrate a config saved by older firmware. */
+        config_check(&config);
+        config_write_flash(&config);
+    } else {
+        ok = FALSE;
+    }
+    if (!ok) {
         printk("\nConfig corrupt: Resetting to Factory Defaults\n");
         config = dfl_config;
     } else if (gpio_pins_connected(gpioa, 1, gpioa, 2)) {
@@ -75,50 +581,38 @@ void config_init(void)
         config_write_flash(&config);
     }
     
-    config_printk(&config);
+    config_printk();
 
     printk("\nKeys:\n Space: Select\n O: Down\n P: Up\n");
 
     // lcd_display_update();
-    (void)usart1->dr;
 }
 
 bool_t config_active;
-struct display config_display = {
-    .cols = 16, .rows = 2, .on = TRUE,
-};
 
-static enum {
-    C_idle = 0,
-    C_banner,
-    /* Output */
-    C_title1,
-    C_title2,
-    C_title3,
-    C_title4,
-    C_tos,
-    C_sound,
-    C_boot,
-    /* Exit */
-    C_save,
-    C_max
-} config_state;
+/* Menu state: idle, the banner, then menu_items[]. */
+enum { C_idle = 0, C_banner, C_items };
+#define C_max (C_items + ARRAY_SIZE(menu_items))
+static unsigned int config_state;
+
+/* Show the progress of the save started on leaving the menu. Saves from the
+ * shell, and at boot, are not shown. */
+static bool_t save_progress;
 
 static void cnf_prt(int row, const char *format, ...)
 {
-    uint8_t len;
     va_list ap;
-    char *r = (char *)config_display.text[row];
-
-    memset(r, 0, 20);
+    char r[17];
 
     va_start(ap, format);
-    (void)vsnprintf(r, 20, format, ap);
+    (void)vsnprintf(r, sizeof(r), format, ap);
     va_end(ap);
-    len = strlen(r);
-    memset(&r[len], ' ', 16-len);
+    display_set_row(LAYER_MENU, row, r);
 
-    printk((row == 0) ? "\n%s%16s " : "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%16s", r, "");
+    /* The menu is on the terminal already if it mirrors the display. */
+    if (display_mirror)
+        return;
+    printk((row == 0) ? "\n%-16s%16s " : "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b%-16s", r, "");
 }
 
 static struct repeat {
@@ -151,49 +645,17 @@ uint8_t button_repeat(uint8_t pb, uint8_t b, uint8_t m, struct repeat *r)
     return b;
 }
 
-uint8_t arrowKeys(uint8_t key)
+void config_process(uint8_t stKey, int conKey)
 {
-    time_t start = time_now();
-    uint8_t i = 0;
-    
-    if(key != 27)
-        return 0;
-    
-    while(time_diff(start, time_now()) < time_ms(100)) 
-    {
-        if (usart1->sr & USART_SR_RXNE) {
-            key = usart1->dr;
-            //printk("key: %d\n", key);
-    	    switch (i) {
-    	        case 0:
-    	   	    if(key != 91) return 0;
-    	        case 1:
-                    switch (key) {
-                        case 65: return B_SELECT;
-                        case 67: return B_RIGHT;
-                        case 68: return B_LEFT;
-    	            }
-            }
-            i++;
-        }
-    }
-    
-    return 0;
-}
-
-void config_process(uint8_t stKey)
-{
-    char c = 0;
-    uint8_t title_idx;
+    const struct menu_item *m;
     uint8_t ascii;
-    uint8_t l;
     uint8_t b;
     uint8_t _b;
     static uint8_t pb;
-    bool_t changed = FALSE;
-    static enum { C_SAVE = 0, C_SAVEREBOOT, C_USE, C_DISCARD,
-                  C_RESET, C_NC_MAX } new_config;
+    bool_t changed = FALSE, redraw;
     static struct config old_config;
+    unsigned int l, v;
+    char *t, r[17];
 
     b = getConfigButtons();
     _b = b;
@@ -203,14 +665,24 @@ void config_process(uint8_t stKey)
     pb = _b;
 
     ascii = keyscan_to_ascii(stKey);
-    if (usart1->sr & USART_SR_RXNE) {
-        c = usart1->dr;
-        // printk("key: %d\n", c);
-        b = arrowKeys(c);
-        if(!b && c>=32 && c<=125)
-            ascii = c;
-        if(c==127)
-            ascii = 8;
+    // printk("key: %d\n", conKey);
+    switch (conKey) {
+    case CONSOLE_KEY_UP:
+        b |= B_SELECT;
+        break;
+    case CONSOLE_KEY_RIGHT:
+        b |= B_RIGHT;
+        break;
+    case CONSOLE_KEY_LEFT:
+        b |= B_LEFT;
+        break;
+    case 127:
+        ascii = 8;
+        break;
+    default:
+        if(conKey>=32 && conKey<=125)
+            ascii = conKey;
+        break;
     }
 
     if (b & B_SELECT) {
@@ -218,11 +690,12 @@ void config_process(uint8_t stKey)
             config_state = C_idle;
             switch (new_config) {
             case C_SAVE:
+                save_progress = TRUE;
                 config_write_flash(&config);
                 break;
             case C_SAVEREBOOT:
+                save_reboot = save_progress = TRUE;
                 config_write_flash(&config);
-                while(1) {} /* hang and let WDT reboot */
                 break;
             case C_USE:
                 break;
@@ -231,101 +704,82 @@ void config_process(uint8_t stKey)
                 break;
             case C_RESET:
                 config = dfl_config;
+                save_reboot = save_progress = TRUE;
                 config_write_flash(&config);
-                while(1) {} /* hang and let WDT reboot */
-                break;
-            case C_NC_MAX:
                 break;
             }
             printk("\n");
-            config_printk(&config);
+            config_printk();
             // lcd_display_update();
         }
         config_active = (config_state != C_idle);
-        if(!config_active)
+        if(config_active || save_progress) {
+            display_show(LAYER_MENU, 0);
+        } else {
+            display_hide(LAYER_MENU);
             hdLedOff();
+        }
         changed = TRUE;
     }
 
-    switch (config_state) {
-    default:
-        break;
-    case C_banner:
+    if (config_state == C_idle) {
+        /* Show the progress of a save started from the menu. */
+        static int shown = -1;
+        int pc = save_busy ? fpec_progress(&save_job) : -1;
+        if (!save_progress || ((pc == shown) && (pc >= 0)))
+            return;
+        if (pc < 0) {
+            display_hide(LAYER_MENU);
+            hdLedOff();
+            save_progress = FALSE;
+        } else {
+            if (shown < 0)
+                cnf_prt(0, "Saving config");
+            cnf_prt(1, "%u%%", pc);
+        }
+        shown = pc;
+        return;
+    }
+
+    if (config_state == C_banner) {
         if (changed) {
             cnf_prt(0, "Atari STe Xtreme");
             cnf_prt(1, "Configuration");
             old_config = config;
-            backlight(1);
-        }
-        break;
-    case C_title1:
-    case C_title2:
-    case C_title3:
-    case C_title4:
-        
-    	title_idx = config_state - C_title1;
-        if (changed)
-            cnf_prt(0, "ROM %u name:", title_idx+1);
-        if(changed || ascii > 0) {
-            l = strlen(config.TOStitle[title_idx]);
-            if(ascii == 8) {
-                if(l > 0)
-                    config.TOStitle[title_idx][l-1] = 0;
-            } else if(l < 16 && ascii > 0) {
-                config.TOStitle[title_idx][l] = ascii;
-                config.TOStitle[title_idx][l+1] = 0;
-            }
-            cnf_prt(1, "%s", config.TOStitle[title_idx]);
-        }
-        break;
-    case C_tos:
-        if (changed)
-            cnf_prt(0, "TOS rom (1-4):");
-        if (b & B_LEFT)
-            config.tos = max_t(uint16_t, config.tos-1, 1);
-        if (b & B_RIGHT)
-            config.tos = min_t(uint16_t, config.tos+1, 4);
-        if (b)
-            cnf_prt(1, "%u", config.tos);
-        break;
-    case C_sound:
-        if (changed)
-            cnf_prt(0, "Sound:");
-        if (b & (B_LEFT|B_RIGHT)) {
-            config.sound ^= 1;
-        }
-        if (b)
-            cnf_prt(1, "%s", config.sound ? "Mono" : "Stereo");
-        break;
-    case C_boot:
-        if (changed)
-            cnf_prt(0, "Boot:");
-        if (b & (B_LEFT|B_RIGHT)) {
-            config.boot ^= 1;
-        }
-        if (b)
-            cnf_prt(1, "%stern", config.boot ? "In" : "Ex");
-        break;
-    case C_save: {
-        const static char *str[] = { "Save", "Save+Reset", "Use",
-                                     "Discard", "Factory Reset" };
-        if (changed) {
-            cnf_prt(0, "Save new Config?");
             new_config = C_SAVEREBOOT;
         }
-        if (b & B_LEFT) {
-            if (new_config > 0)
-                --new_config;
-            else
-                new_config = C_NC_MAX-1;
+        return;
+    }
+
+    m = &menu_items[config_state - C_items];
+    if (changed)
+        cnf_prt(0, "%s", m->label);
+
+    if (m->type == MI_text) {
+        /* Type to append, backspace to delete. */
+        t = m->p;
+        l = strlen(t);
+        if ((ascii == 8) && (l > 0)) {
+            t[l-1] = '\0';
+        } else if ((ascii > 0) && (ascii != 8) && (l < m->max)) {
+            t[l] = ascii;
+            t[l+1] = '\0';
         }
+        redraw = (b || ascii);
+    } else {
+        /* Left/right to step: a range stops at its ends, lists wrap. */
+        v = item_get(m);
+        if (b & B_LEFT)
+            v = (v > m->min) ? v-1 : (m->type == MI_range) ? v : m->max;
         if (b & B_RIGHT)
-            if (++new_config >= C_NC_MAX)
-                new_config = 0;
-        if (b)
-            cnf_prt(1, "%s", str[new_config]);
-        break;
+            v = (v < m->max) ? v+1 : (m->type == MI_range) ? v : m->min;
+        item_set(m, v);
+        redraw = !!b;
     }
+
+    if (redraw) {
+        item_format(m, r, sizeof(r));
+        cnf_prt(1, "%s", r);
     }
 }
 
@@ -1,7 +1,8 @@
 /*
  * console.c
  * 
- * printf-style interface to USART1.
+ * printf-style interface to USART1, deferred-format binary logging, and
+ * console input.
  * 
  * Written & released by Keir Fraser <keir.xen@gmail.com>
  * 
@@ -9,18 +10,44 @@
  * See the file COPYING for more details, or visit <http://unlicense.org>.
  */
 
-#define BAUD 115200
+#define BAUD 115200 /* at reset */
+#define BAUD_MIN 1200
+#define BAUD_MAX 2250000
+#define PCLK2 SYSCLK /* USART1 is clocked from APB2, which is undivided */
+
+static unsigned int baud = BAUD;
+static bool_t rtscts;
 
 #define DMA1_CH4_IRQ 14
 void IRQ_14(void) __attribute__((alias("IRQ_dma1_ch4_tc")));
 
+#define DMA1_CH5_IRQ 15
+void IRQ_15(void) __attribute__((alias("IRQ_dma1_ch5_tc")));
+
 #define USART1_IRQ 37
+void IRQ_37(void) __attribute__((alias("IRQ_usart1")));
 
 /* We stage serial output in a ring buffer. DMA occurs from the ring buffer;
- * the consumer index being updated each time a DMA sequence completes. */
+ * the consumer index being updated each time a DMA sequence completes.
+ * Ring indexes are free running modulo 2^24 (IDX). */
 static char ring[2048];
 #define MASK(x) ((x)&(sizeof(ring)-1))
-static unsigned int cons, prod, dma_sz;
+#define IDX(x) ((x)&0xffffff)
+static volatile unsigned int cons, prod;
+static unsigned int dma_sz;
+
+/* Producers reserve space with cmpxchg on @resv, which holds the reservation
+ * index (bits 0-23) and the number of writers still copying into their
+ * reservations (bits 24-31). Only the reservation and the commit are atomic,
+ * so formatting and copying run with interrupts enabled. The last writer to
+ * commit publishes everything reserved so far by advancing @prod, or any
+ * writer in synchronous mode. */
+static volatile uint32_t resv;
+#define RESV_WRITER (1u<<24)
+
+/* Bytes lost because the ring was full, and how many of those have been
+ * reported on the console. */
+static volatile unsigned int dropped, dropped_reported;
 
 /* The console can be set into synchronous mode in which case DMA is disabled 
  * and the transmit-empty flag is polled manually for each byte. */
@@ -33,12 +60,14 @@ static void kick_tx(void)
         while (cons != prod) {
             while (!(usart1->sr & USART_SR_TXE))
                 cpu_relax();
-            usart1->dr = ring[MASK(cons++)];
+            usart1->dr = ring[MASK(cons)];
+            cons = IDX(cons+1);
         }
 
     } else if (!dma_sz && (cons != prod)) {
 
-        dma_sz = min(MASK(prod-cons), sizeof(ring)-MASK(cons));
+        dma_sz = min_t(unsigned int, IDX(prod-cons),
+                       sizeof(ring)-MASK(cons));
         dma1->ch4.cmar = (uint32_t)(unsigned long)&ring[MASK(cons)];
         dma1->ch4.cndtr = dma_sz;
         dma1->ch4.ccr = (DMA_CCR_MSIZE_8BIT |
@@ -59,42 +88,173 @@ static void IRQ_dma1_ch4_tc(void)
     dma1->ifcr = DMA_IFCR_CGIF(4);
 
     /* Update ring state. */
-    cons += dma_sz;
+    cons = IDX(cons + dma_sz);
     dma_sz = 0;
 
     /* Kick off more transmit activity. */
     kick_tx();
 }
 
-int vprintk(const char *format, va_list ap)
+static void atomic_add(volatile unsigned int *p, unsigned int x)
 {
-    static char str[128];
-    char *p, c;
-    int n;
-    uint32_t oldpri;
+    unsigned int o;
+    do {
+        o = *p;
+    } while (cmpxchg(p, o, o + x) != o);
+}
+
+/* Reserve @len bytes of the ring, returning the index of the first. Fails,
+ * counting the bytes as dropped, if the ring is too full. */
+static bool_t ring_reserve(unsigned int len, unsigned int *p)
+{
+    uint32_t o, n;
+
+    do {
+        o = resv;
+        if (len > (sizeof(ring) - 1 - IDX(IDX(o) - cons))) {
+            atomic_add(&dropped, len);
+            return FALSE;
+        }
+        n = ((o & ~IDX(~0u)) + RESV_WRITER) | IDX(o + len);
+    } while (cmpxchg(&resv, o, n) != o);
+
+    *p = IDX(o);
+    return TRUE;
+}
+
+/* Done copying into a reservation. */
+static void ring_commit(void)
+{
+    uint32_t o, n, p, d, oldpri;
+
+    do {
+        o = resv;
+        n = o - RESV_WRITER;
+    } while (cmpxchg(&resv, o, n) != o);
+
+    if (sync_console) {
+        /* Writers we preempted may never get to commit (a fault, a reset):
+         * publish everything, partial reservations included. */
+        prod = IDX(n);
+        kick_tx();
+        return;
+    }
+
+    if (n >= RESV_WRITER)
+        return; /* the last writer out will publish */
+
+    /* Advance @prod to IDX(n), unless a later commit has already gone past
+     * it while we were preempted. */
+    do {
+        p = prod;
+        d = IDX(IDX(n) - p);
+        if (!d || (d >= (1u<<23)))
+            break;
+    } while (cmpxchg(&prod, p, IDX(n)) != p);
 
     oldpri = IRQ_save(TIMER_IRQ_PRI);
+    kick_tx();
+    IRQ_restore(oldpri);
+}
 
-    n = vsnprintf(str, sizeof(str), format, ap);
+/* Copy @str into the ring at @p, converting LF to CR/LF. */
+static void ring_copy(unsigned int p, const char *str)
+{
+    char c;
 
-    p = str;
-    while (((c = *p++) != '\0') && ((prod-cons) != (sizeof(ring) - 1))) {
+    while ((c = *str++) != '\0') {
         switch (c) {
         case '\r': /* CR: ignore as we generate our own CR/LF */
             break;
         case '\n': /* LF: convert to CR/LF (usual terminal behaviour) */
-            ring[MASK(prod++)] = '\r';
+            ring[MASK(p++)] = '\r';
             /* fall through */
         default:
-            ring[MASK(prod++)] = c;
+            ring[MASK(p++)] = c;
             break;
         }
     }
+}
 
-    kick_tx();
+/* Length of @str in the ring. */
+static unsigned int ring_len(const char *str)
+{
+    unsigned int len = 0;
+    char c;
 
-    IRQ_restore(oldpri);
+    while ((c = *str++) != '\0')
+        len += (c == '\n') ? 2 : (c == '\r') ? 0 : 1;
+    return len;
+}
+
+/* Messages are formatted in static buffers, not on the 512-byte stacks: one
+ * for each context which may be printing at once (the thread and nested
+ * interrupts). A writer claims a free buffer with cmpxchg on @fmt_busy, and
+ * owns it until its message is copied into its own ring reservation. If all
+ * are taken the message is dropped, and counted as such. */
+static char fmt_buf[4][128];
+static volatile uint32_t fmt_busy;
+
+static char *fmt_claim(void)
+{
+    uint32_t o;
+    unsigned int i;
+
+    do {
+        o = fmt_busy;
+        for (i = 0; o & (1u<<i); i++)
+            if (i == ARRAY_SIZE(fmt_buf)-1)
+                return NULL;
+    } while (cmpxchg(&fmt_busy, o, o | (1u<<i)) != o);
 
+    return fmt_buf[i];
+}
+
+static void fmt_release(char *buf)
+{
+    uint32_t o, m = 1u << ((buf - fmt_buf[0]) / sizeof(fmt_buf[0]));
+
+    do {
+        o = fmt_busy;
+    } while (cmpxchg(&fmt_busy, o, o & ~m) != o);
+}
+
+/* Append @str to the ring, whole or not at all. */
+static bool_t ring_print(const char *str)
+{
+    unsigned int p;
+
+    if (!ring_reserve(ring_len(str), &p))
+        return FALSE;
+    ring_copy(p, str);
+    ring_commit();
+    return TRUE;
+}
+
+int vprintk(const char *format, va_list ap)
+{
+    char *str, c;
+    unsigned int d;
+    int n;
+
+    if ((str = fmt_claim()) == NULL) {
+        /* Just the length: with room for only the NUL. */
+        n = vsnprintf(&c, 1, format, ap);
+        atomic_add(&dropped, n);
+        return n;
+    }
+
+    /* Report lost output before the next message which makes it. */
+    if ((d = dropped - dropped_reported) != 0) {
+        snprintf(str, sizeof(fmt_buf[0]), "\n[%u bytes dropped]\n", d);
+        if (ring_print(str))
+            atomic_add(&dropped_reported, d);
+    }
+
+    n = vsnprintf(str, sizeof(fmt_buf[0]), format, ap);
+    ring_print(str);
+
+    fmt_release(str);
     return n;
 }
 
@@ -110,6 +270,197 @@ int printk(const char *format, ...)
     return n;
 }
 
+/* A deferred-format log record is a marker byte (LOGK_MARKER | number of
+ * args) followed by the format string address, the SysTick timestamp and the
+ * args, each 32-bit little endian. The marker is not ASCII so the host can
+ * pick records out of the text stream. A record is written whole or not at
+ * all. */
+#define LOGK_MARKER 0xf8
+void logk_record(const char *format, unsigned int nr, const uint32_t *args)
+{
+    uint32_t w[2 + LOGK_MAX_ARGS];
+    const uint8_t *b = (const uint8_t *)w;
+    unsigned int i, n, p;
+
+    nr = min_t(unsigned int, nr, LOGK_MAX_ARGS);
+    w[0] = (uint32_t)(unsigned long)format;
+    w[1] = stk_now();
+    for (i = 0; i < nr; i++)
+        w[2+i] = args[i];
+    n = (2 + nr) * 4;
+
+    if (!ring_reserve(n + 1, &p))
+        return;
+    ring[MASK(p++)] = LOGK_MARKER | nr;
+    for (i = 0; i < n; i++)
+        ring[MASK(p++)] = b[i];
+    ring_commit();
+}
+
+unsigned int console_dropped(void)
+{
+    return dropped;
+}
+
+unsigned int console_space(void)
+{
+    return sizeof(ring) - 1 - IDX(IDX(resv) - cons);
+}
+
+/* Console input is received by DMA1 channel 5 in circular mode, so it costs
+ * nothing until the main loop looks at it. The USART's idle-line interrupt
+ * records where each burst of input ends: an ESC at the end of a burst is the
+ * Escape key rather than the start of an escape sequence. The ring holds
+ * about 1ms of input at the highest rates: if the main loop is slower than
+ * that, the DMA laps us (counted by the transfer-complete interrupt) and the
+ * input is dropped, rather than read as a mix of old and new. */
+static uint8_t rx_ring[256];
+#define RX_MASK(x) ((x)&(sizeof(rx_ring)-1))
+static unsigned int rx_cons; /* free running */
+static volatile unsigned int rx_laps, rx_idle_pos = ~0u;
+static unsigned int rx_lost;
+#define rx_prod() RX_MASK(sizeof(rx_ring) - dma1->ch5.cndtr)
+
+static void IRQ_dma1_ch5_tc(void)
+{
+    dma1->ifcr = DMA_IFCR_CTCIF(5);
+    rx_laps++;
+}
+
+static void IRQ_usart1(void)
+{
+    /* SR then DR read clears IDLE. DMA has already taken the data. */
+    (void)usart1->sr;
+    (void)usart1->dr;
+    rx_idle_pos = rx_prod();
+}
+
+/* Bytes received so far, free running like rx_cons. Just after the DMA
+ * wraps, before its interrupt is taken, this runs a lap behind: that only
+ * looks like no new input. */
+static unsigned int rx_received(void)
+{
+    unsigned int laps, pos;
+
+    do {
+        laps = rx_laps;
+        pos = sizeof(rx_ring) - dma1->ch5.cndtr;
+    } while (laps != rx_laps);
+
+    return laps * sizeof(rx_ring) + pos;
+}
+
+static enum { RX_normal, RX_esc, RX_csi } rx_state;
+
+int console_getkey(void)
+{
+    unsigned int prod = rx_received();
+    int c;
+
+    if ((int)(prod - rx_cons) > (int)sizeof(rx_ring)) {
+        /* Overrun: unread input has been overwritten. */
+        rx_lost += prod - rx_cons;
+        rx_cons = prod;
+        rx_state = RX_normal;
+    }
+
+    while ((int)(prod - rx_cons) > 0) {
+        c = rx_ring[RX_MASK(rx_cons)];
+        rx_cons++;
+        switch (rx_state) {
+        case RX_normal:
+            if (c == 27) {
+                rx_state = RX_esc;
+                break;
+            }
+            return c;
+        case RX_esc:
+            if ((c == '[') || (c == 'O')) {
+                rx_state = RX_csi;
+                break;
+            }
+            /* Not a sequence: drop the ESC. */
+            rx_state = RX_normal;
+            return c;
+        case RX_csi:
+            /* Skip parameter and intermediate bytes up to the final byte. */
+            if ((c < 0x40) || (c > 0x7e))
+                break;
+            rx_state = RX_normal;
+            switch (c) {
+            case 'A': return CONSOLE_KEY_UP;
+            case 'B': return CONSOLE_KEY_DOWN;
+            case 'C': return CONSOLE_KEY_RIGHT;
+            case 'D': return CONSOLE_KEY_LEFT;
+            }
+            break;
+        }
+    }
+
+    /* The line went idle part way through a sequence. */
+    if ((rx_state != RX_normal) && (rx_idle_pos == RX_MASK(rx_cons))) {
+        c = (rx_state == RX_esc) ? 27 : -1;
+        rx_state = RX_normal;
+        return c;
+    }
+
+    return -1;
+}
+
+unsigned int console_rx_lost(void)
+{
+    return rx_lost;
+}
+
+bool_t console_tx_idle(void)
+{
+    return (cons == IDX(resv)) && !dma_sz && (usart1->sr & USART_SR_TC);
+}
+
+unsigned int console_baud_actual(unsigned int rate)
+{
+    unsigned int actual;
+
+    if ((rate < BAUD_MIN) || (rate > BAUD_MAX))
+        return 0;
+
+    /* BRR is PCLK2/rate in 1/16ths of a bit (16x oversampling). */
+    actual = PCLK2 / ((PCLK2 + rate/2) / rate);
+
+    /* Allow up to 2% error. */
+    return ((actual > rate ? actual - rate : rate - actual) > rate/50)
+        ? 0 : actual;
+}
+
+void console_set_baud(unsigned int rate, bool_t flow)
+{
+    /* PA11: CTS (pulled active if not connected), PA12: RTS. */
+    if (flow) {
+        gpio_configure_pin(gpioa, 11, GPI_pull_down);
+        gpio_configure_pin(gpioa, 12, AFO_pushpull(_10MHz));
+    } else {
+        gpio_configure_pin(gpioa, 11, GPI_pull_up);
+        gpio_configure_pin(gpioa, 12, GPI_pull_up);
+    }
+
+    usart1->cr1 &= ~USART_CR1_UE;
+    usart1->brr = (PCLK2 + rate/2) / rate;
+    if (flow)
+        usart1->cr3 |= USART_CR3_CTSE | USART_CR3_RTSE;
+    else
+        usart1->cr3 &= ~(USART_CR3_CTSE | USART_CR3_RTSE);
+    usart1->cr1 |= USART_CR1_UE;
+
+    baud = PCLK2 / usart1->brr;
+    rtscts = flow;
+}
+
+unsigned int console_get_baud(bool_t *flow)
+{
+    *flow = rtscts;
+    return baud;
+}
+
 void console_sync(void)
 {
     if (sync_console)
@@ -119,9 +470,11 @@ void console_sync(void)
 
     sync_console = TRUE;
 
-    /* Wait for DMA completion and then kick off synchronous mode. */
+    /* Wait for DMA completion and then kick off synchronous mode, with
+     * whatever is reserved: see ring_commit(). */
     while (dma1->ch4.cndtr)
         cpu_relax();
+    prod = IDX(resv);
     IRQ_dma1_ch4_tc();
 
     /* Leave IRQs globally disabled. */
@@ -144,15 +497,36 @@ void console_init(void)
     gpio_configure_pin(gpioa, 10, GPI_pull_up);
 
     /* BAUD, 8n1. */
-    usart1->brr = SYSCLK / BAUD;
-    usart1->cr1 = (USART_CR1_UE | USART_CR1_TE | USART_CR1_RE);
-    usart1->cr3 = USART_CR3_DMAT;
+    usart1->brr = PCLK2 / BAUD;
+    usart1->cr1 = (USART_CR1_UE | USART_CR1_TE | USART_CR1_RE |
+                   USART_CR1_IDLEIE);
+    usart1->cr3 = USART_CR3_DMAT | USART_CR3_DMAR;
 
     /* Initialise DMA1 channel 4 and its completion interrupt. */
     dma1->ch4.cpar = (uint32_t)(unsigned long)&usart1->dr;
     dma1->ifcr = DMA_IFCR_CGIF(4);
     IRQx_set_prio(DMA1_CH4_IRQ, CONSOLE_IRQ_PRI);
     IRQx_enable(DMA1_CH4_IRQ);
+
+    /* Receive forever into rx_ring via DMA1 channel 5. */
+    dma1->ch5.cpar = (uint32_t)(unsigned long)&usart1->dr;
+    dma1->ch5.cmar = (uint32_t)(unsigned long)rx_ring;
+    dma1->ch5.cndtr = sizeof(rx_ring);
+    dma1->ch5.ccr = (DMA_CCR_MSIZE_8BIT |
+                     DMA_CCR_PSIZE_16BIT |
+                     DMA_CCR_MINC |
+                     DMA_CCR_CIRC |
+                     DMA_CCR_DIR_P2M |
+                     DMA_CCR_TCIE |
+                     DMA_CCR_EN);
+    dma1->ifcr = DMA_IFCR_CGIF(5);
+    IRQx_set_prio(DMA1_CH5_IRQ, CONSOLE_IRQ_PRI);
+    IRQx_enable(DMA1_CH5_IRQ);
+
+    /* Idle-line detection. */
+    IRQx_set_prio(USART1_IRQ, CONSOLE_IRQ_PRI);
+    IRQx_clear_pending(USART1_IRQ);
+    IRQx_enable(USART1_IRQ);
 }
 
 /*
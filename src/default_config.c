@@ -17,8 +17,11 @@ const static struct config dfl_config = {
         "TOS name unknown", // F4
     },
     .tos = 1,
-    .sound = 0,
-    .boot = 1,
+    .sound = { 0, 0, 0, 0 },
+    .boot = { 1, 1, 1, 1 },
+    .lcd_cols = 16,
+    .lcd_rows = 2,
+    .sh1106 = 0,
 
 };
 
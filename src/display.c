@@ -0,0 +1,379 @@
+/*
+ * display.c
+ *
+ * Compose the LCD/OLED contents from prioritised layers: FlashFloppy text,
+ * status bar, notifications and the config menu. Only rows which change in
+ * the composed frame are sent to the display, whichever layer changed them.
+ *
+ * Written & released by Frank Beentjes <frankbeen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+static struct layer {
+    uint8_t text[4][40];
+    bool_t shown;
+    volatile uint8_t timeout; /* 100ms ticks until hidden; 0 = no timeout */
+} layers[NR_LAYERS];
+
+/* Bitmaps of the GLYPH_* codes used by the layers above the base. */
+static const uint8_t layer_glyphs[8][8] = {
+    [1] = { 0x04, 0x0e, 0x15, 0x04, 0x04, 0x04, 0x04, 0x00 }, /* up */
+    [2] = { 0x04, 0x04, 0x04, 0x04, 0x15, 0x0e, 0x04, 0x00 }, /* down */
+    [3] = { 0x00, 0x04, 0x02, 0x1f, 0x02, 0x04, 0x00, 0x00 }, /* right */
+    [4] = { 0x1f, 0x11, 0x11, 0x1f, 0x1b, 0x1b, 0x1f, 0x00 }, /* disk */
+    [5] = { 0x00, 0x0d, 0x13, 0x17, 0x10, 0x11, 0x0e, 0x00 }, /* reset */
+};
+
+/* Text last sent to each row of the display. */
+static uint8_t current_lcd_text[4][40];
+
+/* VT100 mirror of the display on the serial console. All rows of the
+ * FlashFloppy display are drawn in a box at the top of the terminal, with the
+ * other layers over the rows they cover on the LCD. Other console output
+ * scrolls in the region below the box. Only changed cells are sent, and only
+ * while the console ring is mostly empty. */
+bool_t display_mirror;
+#define MIRROR_ROWS 4
+#define MIRROR_SPACE 512 /* console ring space needed to send an update */
+static uint8_t mirror_text[MIRROR_ROWS][40]; /* what the terminal shows */
+static uint8_t mirror_cols; /* width of the box drawn, 0 if none */
+/* Stand-ins for the layer glyphs (GLYPH_*) on the terminal. */
+static const char mirror_glyphs[] = " ^v>#@**";
+
+/* Horizontal scrolling of FlashFloppy rows that are wider than the display. */
+#define SCROLL_STEP  3  /* 0.3 seconds per column */
+#define SCROLL_PAUSE 15 /* 1.5 seconds at either end */
+static struct {
+    uint8_t width; /* number of columns being scrolled, 0 if not scrolling */
+    uint8_t pos;   /* first visible column */
+    bool_t hw;     /* scrolling with the display shift command? */
+} scroll;
+static volatile uint8_t scroll_timer;
+
+/* Rows of the display covered by each layer. */
+static uint8_t layer_rows(unsigned int layer)
+{
+    switch (layer) {
+    case LAYER_STATUS:
+        return 1u << (lcd_rows - 1);
+    case LAYER_TOAST:
+        return 0x3;
+    default:
+        return 0xf;
+    }
+}
+
+void display_set_row(unsigned int layer, unsigned int row, const char *text)
+{
+    uint8_t *r = layers[layer].text[row];
+    unsigned int len = strnlen(text, sizeof(layers[layer].text[row]));
+
+    memcpy(r, text, len);
+    memset(&r[len], ' ', sizeof(layers[layer].text[row]) - len);
+}
+
+void display_show(unsigned int layer, uint8_t timeout)
+{
+    layers[layer].timeout = timeout;
+    layers[layer].shown = TRUE;
+}
+
+void display_hide(unsigned int layer)
+{
+    layers[layer].shown = FALSE;
+    layers[layer].timeout = 0;
+}
+
+void display_tick(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_LAYERS; i++) {
+        struct layer *l = &layers[i];
+        if (l->timeout && !--l->timeout)
+            l->shown = FALSE;
+    }
+
+    if (scroll_timer)
+        scroll_timer--;
+}
+
+void notify(const char *line1, const char *line2)
+{
+    display_set_row(LAYER_TOAST, 0, line1);
+    display_set_row(LAYER_TOAST, 1, line2);
+    display_show(LAYER_TOAST, 30); /* 3 seconds */
+}
+
+/* Compare a row with what the display shows, and update it when needed.
+ * Custom glyph codes in @text are bitmaps in @cgram, and are mapped to
+ * whichever CGRAM slots hold those bitmaps. */
+static void refresh_row(const uint8_t *text, uint8_t row, uint8_t len,
+                        const uint8_t (*cgram)[8])
+{
+    uint8_t out[40], c;
+    unsigned int i;
+    int g;
+
+    for (i = 0; i < len; i++) {
+        c = text[i];
+        if (c < 16) {
+            /* HD44780 codes 8-15 alias 0-7. */
+            g = lcd_glyph(cgram[c & 7]);
+            c = (g < 0) ? '?' : g;
+        }
+        out[i] = c;
+    }
+
+    if (!memcmp(current_lcd_text[row], out, len))
+        return;
+    if (lcd_refresh(out, row, len))
+        memcpy(current_lcd_text[row], out, len);
+}
+
+/* Scroll back to the first column and pause there. */
+static void scroll_restart(void)
+{
+    if (scroll.hw && scroll.pos)
+        lcd_shift_home();
+    scroll.pos = 0;
+    scroll_timer = SCROLL_PAUSE;
+}
+
+/* Stop scrolling, e.g. when another layer covers the FlashFloppy text. */
+static void scroll_stop(void)
+{
+    if (scroll.width)
+        scroll_restart();
+    scroll.width = 0;
+}
+
+/* Show the FlashFloppy text, scrolling rows which are wider than the display.
+ * On a 2-row LCD whole rows are written to DDRAM and the display shift moves
+ * the visible window, costing one command per step. The display shift of a
+ * 4-row LCD would mix up its rows, so there we rewrite the visible window. */
+static void scroll_display(const struct display *d, uint8_t first)
+{
+    uint8_t row, width = min_t(int, d->cols, 40);
+    bool_t hw = (lcd_rows == 2);
+
+    if (width <= lcd_cols)
+        width = 0;
+
+    if ((width != scroll.width) || (hw != scroll.hw)) {
+        scroll_stop();
+        scroll.width = width;
+        scroll.hw = hw;
+    }
+
+    if (!width) {
+        for (row = 0; row < lcd_rows; row++)
+            refresh_row(d->text[first+row], row, lcd_cols, d->cgram);
+        return;
+    }
+
+    for (row = 0; row < lcd_rows; row++) {
+        if (hw)
+            refresh_row(d->text[first+row], row, width, d->cgram);
+        else
+            refresh_row(&d->text[first+row][scroll.pos],
+                        row, lcd_cols, d->cgram);
+    }
+
+    if (scroll_timer)
+        return;
+
+    if (scroll.pos >= width - lcd_cols) {
+        /* At the end: jump back to the start. */
+        scroll_restart();
+        return;
+    }
+
+    if (hw && !lcd_shift_left())
+        return;
+    scroll.pos++;
+    scroll_timer = (scroll.pos >= width - lcd_cols)
+        ? SCROLL_PAUSE : SCROLL_STEP;
+}
+
+/* Compose the mirror frame: printable ASCII only. */
+static void mirror_compose(uint8_t frame[MIRROR_ROWS][40], uint8_t first)
+{
+    const struct display *d = &i2c_display;
+    static const uint8_t blank[8];
+    unsigned int i, row, x;
+    uint8_t c;
+
+    for (row = 0; row < MIRROR_ROWS; row++) {
+        for (x = 0; x < 40; x++) {
+            c = d->text[row][x];
+            if (c < 16)
+                c = memcmp(d->cgram[c&7], blank, 8) ? '*' : ' ';
+            frame[row][x] = ((c < 0x20) || (c > 0x7e)) ? '?' : c;
+        }
+    }
+
+    for (row = 0; row < lcd_rows; row++) {
+        for (i = NR_LAYERS-1; i > LAYER_BASE; i--)
+            if (layers[i].shown && (layer_rows(i) & (1u << row)))
+                break;
+        if (i == LAYER_BASE)
+            continue;
+        for (x = 0; x < 40; x++) {
+            c = (x < lcd_cols) ? layers[i].text[row][x] : ' ';
+            if (c < 8)
+                c = mirror_glyphs[c];
+            frame[first+row][x] = ((c < 0x20) || (c > 0x7e)) ? '?' : c;
+        }
+    }
+}
+
+static void mirror_process(uint8_t first)
+{
+    uint8_t frame[MIRROR_ROWS][40], cols;
+    char out[120], dashes[41];
+    unsigned int row, x, end, gap, n;
+
+    if (!display_mirror) {
+        if (mirror_cols) {
+            /* Reset the scrolling region and clear the screen. */
+            printk("\033[r\033[2J\033[H");
+            mirror_cols = 0;
+        }
+        return;
+    }
+
+    if (console_space() < MIRROR_SPACE)
+        return;
+
+    cols = max_t(uint8_t, lcd_cols, min_t(int, i2c_display.cols, 40));
+    mirror_compose(frame, first);
+
+    if (cols != mirror_cols) {
+        /* Draw an empty box, and scroll other output below it. */
+        memset(dashes, '-', cols);
+        dashes[cols] = '\0';
+        printk("\033[r\033[2J\033[H+%s+\n", dashes);
+        memset(dashes, ' ', cols);
+        for (row = 0; row < MIRROR_ROWS; row++)
+            printk("|%s|\n", dashes);
+        memset(dashes, '-', cols);
+        printk("+%s+\n\033[%ur\033[%u;1H",
+               dashes, MIRROR_ROWS+3, MIRROR_ROWS+3);
+        memset(mirror_text, ' ', sizeof(mirror_text));
+        mirror_cols = cols;
+        return;
+    }
+
+    /* Save the cursor, send runs of changed cells, restore the cursor. We
+     * stop when the buffer is full: the rest goes next time. */
+    n = snprintf(out, sizeof(out), "\0337");
+    for (row = 0; row < MIRROR_ROWS; row++) {
+        for (x = 0; x < cols; x = end) {
+            if (frame[row][x] == mirror_text[row][x]) {
+                end = x + 1;
+                continue;
+            }
+            /* Extend the run over short unchanged gaps, which are cheaper
+             * to resend than to skip with another cursor move. */
+            for (end = x + 1; end < cols; end += gap + 1) {
+                gap = 0;
+                while ((end + gap < cols) && (gap < 4)
+                       && (frame[row][end+gap] == mirror_text[row][end+gap]))
+                    gap++;
+                if ((gap == 4) || (end + gap >= cols))
+                    break;
+            }
+            if ((n + 10 + (end - x) + 2) >= sizeof(out))
+                goto done;
+            n += snprintf(&out[n], sizeof(out)-n, "\033[%u;%uH",
+                          row+2, x+2);
+            memcpy(&out[n], &frame[row][x], end - x);
+            memcpy(&mirror_text[row][x], &frame[row][x], end - x);
+            n += end - x;
+        }
+    }
+done:
+    if (n == 2)
+        return; /* nothing changed */
+    out[n] = '\0';
+    printk("%s\0338", out);
+}
+
+void display_invalidate(void)
+{
+    /* The display has been cleared, which also undoes any display shift. */
+    memset(current_lcd_text, ' ', sizeof(current_lcd_text));
+    scroll.width = scroll.pos = 0;
+}
+
+void display_init(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < NR_LAYERS; i++)
+        memset(layers[i].text, ' ', sizeof(layers[i].text));
+    memset(current_lcd_text, ' ', sizeof(current_lcd_text));
+    lcd_init();
+}
+
+void process_display(void)
+{
+    const struct display *d = &i2c_display;
+    /* On a 2-row display we show the middle rows of a 4-row FlashFloppy
+     * screen; on a 4-row display we mirror the whole screen. */
+    uint8_t first = (lcd_rows >= 4) ? 0 : 1;
+    uint8_t row, covered = 0;
+    bool_t bl_on = d->on;
+    unsigned int i;
+
+    mirror_process(first);
+
+    /* Nothing to do while the display link is down. */
+    if (!lcd_ready())
+        return;
+
+    lcd_glyph_frame();
+
+    for (i = LAYER_BASE+1; i < NR_LAYERS; i++) {
+        if (!layers[i].shown)
+            continue;
+        covered |= layer_rows(i);
+        /* Notifications and the menu light up the display. */
+        if (i >= LAYER_TOAST)
+            bl_on = TRUE;
+    }
+    covered &= (1u << lcd_rows) - 1;
+
+    if (!covered) {
+        scroll_display(d, first);
+    } else {
+        scroll_stop();
+        for (row = 0; row < lcd_rows; row++) {
+            /* Topmost shown layer covering this row. */
+            for (i = NR_LAYERS-1; i > LAYER_BASE; i--)
+                if (layers[i].shown && (layer_rows(i) & (1u << row)))
+                    break;
+            if (i == LAYER_BASE)
+                refresh_row(d->text[first+row], row, lcd_cols, d->cgram);
+            else
+                refresh_row(layers[i].text[row], row, lcd_cols,
+                            layer_glyphs);
+        }
+    }
+
+    if (bl_on != isBacklightOn())
+        backlight(bl_on);
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
@@ -24,6 +24,15 @@
 /* Current position in FF OSD I2C Protocol character data. */
 static uint8_t ff_osd_x, ff_osd_y;
 
+/* FF OSD protocol v1 extended (delta update) command state. */
+static struct {
+    uint8_t cmd;      /* command awaiting argument bytes, or 0 */
+    bool_t have_len;  /* OSD_RUN/OSD_REPEAT: length byte received? */
+    uint8_t len;      /* OSD_RUN/OSD_REPEAT: characters remaining */
+    uint8_t x, y;     /* cursor for OSD_RUN/OSD_REPEAT */
+    bool_t active;    /* has the host used delta updates? */
+} ff_osd_ext;
+
 /* STM32 I2C peripheral. */
 #define i2c i2c1
 #define SCL 6
@@ -37,24 +46,34 @@ void IRQ_32(void) __attribute__((alias("IRQ_i2c_error")));
 #define I2C_EVENT_IRQ 31
 void IRQ_31(void) __attribute__((alias("IRQ_i2c_event")));
 
-/* I2C data ring. */
-static uint8_t d_ring[1024];
-static uint16_t d_cons, d_prod;
+/* We respond to both protocols at once: the PCF8574 LCD backpack address in
+ * OAR1 and the FF OSD address in OAR2. Each has its own receive rings so
+ * that the decoders never see each other's data. */
+#define LCD_ADDR    0x27
+#define FF_OSD_ADDR 0x10
+
+struct i2c_ring {
+    /* I2C data ring. */
+    uint8_t d[1024];
+    uint16_t d_cons, d_prod;
+    /* Transaction ring: Data-ring offset of each transaction start. */
+    uint16_t t[8];
+    uint16_t t_cons, t_prod;
+};
+static struct i2c_ring lcd_ring, osd_ring;
 #define MASK(r,x) ((x) & (ARRAY_SIZE(r)-1))
 
-/* Transaction ring: Data-ring offset of each transaction start. */
-static uint16_t t_ring[8];
-static uint16_t t_cons, t_prod;
-
 /* Display state, exported to display routines. */
 struct display i2c_display;
 
 /* LCD state. */
 static bool_t lcd_inc;
 static uint8_t lcd_ddraddr;
+static uint8_t lcd_cgaddr;
+static bool_t lcd_cgram; /* data goes to CGRAM rather than DDRAM? */
 
 /* I2C custom protocol state. */
-bool_t i2c_osd_protocol; /* using the custom protocol? */
+bool_t i2c_osd_protocol; /* has the host addressed us as FF OSD? */
 uint8_t i2c_buttons_rx; /* button state: Gotek -> OSD */
 struct i2c_osd_info i2c_osd_info; /* state: OSD -> Gotek */
 
@@ -70,13 +89,26 @@ static void IRQ_i2c_error(void)
 static void IRQ_i2c_event(void)
 {
     static uint8_t rp;
+    static struct i2c_ring *rx = &lcd_ring;
+    static bool_t tx_osd;
+    static struct i2c_osd_info tx_info;
     uint16_t sr1 = i2c->sr1;
 
     if (sr1 & I2C_SR1_ADDR) {
-        /* Read SR2 clears SR1_ADDR. */
+        /* Read SR2 clears SR1_ADDR. DUALF tells us which address matched. */
         uint16_t sr2 = i2c->sr2;
-        if (!(sr2 & I2C_SR2_TRA))
-            t_ring[MASK(t_ring, t_prod++)] = d_prod;
+        bool_t osd = !!(sr2 & I2C_SR2_DUALF);
+        if (!(sr2 & I2C_SR2_TRA)) {
+            rx = osd ? &osd_ring : &lcd_ring;
+            rx->t[MASK(rx->t, rx->t_prod++)] = rx->d_prod;
+        } else {
+            /* Snapshot the info block so that the host reads a consistent
+             * copy however long it takes over the read. */
+            tx_info = i2c_osd_info;
+        }
+        if (osd)
+            i2c_osd_protocol = TRUE;
+        tx_osd = osd;
         rp = 0;
     }
 
@@ -87,13 +119,14 @@ static void IRQ_i2c_event(void)
 
     if (sr1 & I2C_SR1_RXNE) {
         /* Read DR clears SR1_RXNE. */
-        d_ring[MASK(d_ring, d_prod++)] = i2c->dr;
+        rx->d[MASK(rx->d, rx->d_prod++)] = i2c->dr;
     }
 
     if (sr1 & I2C_SR1_TXE) {
-        /* Write DR clears SR1_TXE. */
-        uint8_t *info = (uint8_t *)&i2c_osd_info;
-        i2c->dr = (rp < sizeof(i2c_osd_info)) ? info[rp++] : 0;
+        /* Write DR clears SR1_TXE. Only the FF OSD address has anything
+         * to say; reads of the LCD backpack return zeroes. */
+        uint8_t *info = (uint8_t *)&tx_info;
+        i2c->dr = (tx_osd && (rp < sizeof(tx_info))) ? info[rp++] : 0;
     }
 }
 
@@ -105,37 +138,95 @@ static void IRQ_i2c_event(void)
 #define OSD_BUTTONS      0x30 /* [3:0] = button mask */
 #define OSD_COLUMNS      0x40 /* [6:0] = #columns */
 
+/* FF OSD protocol v1: delta updates. The host may send only those spans of
+ * the screen which have changed, rather than a full OSD_DATA frame.
+ * FF OSD protocol v2: i2c_osd_info is extended with ST machine state. */
+#define FF_OSD_PROTOCOL_VER 2
+#define OSD_CURSOR       0x80 /* [1:0] = row; next byte = column */
+#define OSD_RUN          0x90 /* next byte = N; next N bytes are text data */
+#define OSD_REPEAT       0xa0 /* next byte = N; next byte is repeated N times */
+
+static void ff_osd_ext_put(uint8_t c)
+{
+    if (ff_osd_ext.x < ARRAY_SIZE(i2c_display.text[0]))
+        i2c_display.text[ff_osd_ext.y][ff_osd_ext.x++] = c;
+}
+
+/* Consume an argument byte of an extended command. */
+static void ff_osd_ext_process(uint8_t x)
+{
+    if (ff_osd_ext.cmd == OSD_CURSOR) {
+        ff_osd_ext.x = x;
+        ff_osd_ext.cmd = 0;
+        return;
+    }
+
+    if (!ff_osd_ext.have_len) {
+        ff_osd_ext.have_len = TRUE;
+        if ((ff_osd_ext.len = x) == 0)
+            ff_osd_ext.cmd = 0;
+        return;
+    }
+
+    if (ff_osd_ext.cmd == OSD_RUN) {
+        ff_osd_ext_put(x);
+        if (--ff_osd_ext.len == 0)
+            ff_osd_ext.cmd = 0;
+    } else { /* OSD_REPEAT */
+        while (ff_osd_ext.len--)
+            ff_osd_ext_put(x);
+        ff_osd_ext.cmd = 0;
+    }
+}
+
 static void ff_osd_process(void)
 {
+    struct i2c_ring *r = &osd_ring;
     uint16_t d_c, d_p, t_c, t_p;
 
-    d_c = d_cons;
-    d_p = d_prod;
+    d_c = r->d_cons;
+    d_p = r->d_prod;
     barrier(); /* Get data ring producer /then/ transaction ring producer */
-    t_c = t_cons;
-    t_p = t_prod;
-
-    /* We only care about the last full transaction, and newer. */
-    if ((uint16_t)(t_p - t_c) >= 2) {
+    t_c = r->t_cons;
+    t_p = r->t_prod;
+
+    /* We only care about the last full transaction, and newer. Delta
+     * updates depend on every earlier transaction, so in that case we only
+     * discard to stop the data or transaction ring from overrunning. Once
+     * the transaction ring has wrapped, the boundaries of the oldest
+     * pending transactions are lost and we must resync to the newest. */
+    if (((uint16_t)(t_p - t_c) >= 2)
+        && (!ff_osd_ext.active
+            || ((uint16_t)(d_p - d_c) >= (ARRAY_SIZE(r->d)/2))
+            || ((uint16_t)(t_p - t_c) >= ARRAY_SIZE(r->t)))) {
         /* Discard older transactions, and in-progress old transaction. */
         t_c = t_p - 2;
-        d_c = t_ring[MASK(t_ring, t_c)];
+        d_c = r->t[MASK(r->t, t_c)];
         ff_osd_y = 0;
+        ff_osd_ext.cmd = 0;
     }
 
     /* Data ring should not be more than half full. We don't want it to 
      * overrun during the processing loop below: That should be impossible
      * with half a ring free. */
-    ASSERT((uint16_t)(d_p - d_c) < (ARRAY_SIZE(d_ring)/2));
+    ASSERT((uint16_t)(d_p - d_c) < (ARRAY_SIZE(r->d)/2));
+
+    /* Every pending transaction boundary must still be in the ring, so that
+     * command state is reset at each of them below. */
+    ASSERT((uint16_t)(t_p - t_c) < ARRAY_SIZE(r->t));
 
     /* Process the command sequence. */
     for (; d_c != d_p; d_c++) {
-        uint8_t x = d_ring[MASK(d_ring, d_c)];
-        if ((t_c != t_p) && (d_c == t_ring[MASK(t_ring, t_c)])) {
+        uint8_t x = r->d[MASK(r->d, d_c)];
+        if ((t_c != t_p) && (d_c == r->t[MASK(r->t, t_c)])) {
             t_c++;
             ff_osd_y = 0;
+            ff_osd_ext.cmd = 0;
         }
-        if (ff_osd_y != 0) {
+        if (ff_osd_ext.cmd != 0) {
+            /* Extended command argument. */
+            ff_osd_ext_process(x);
+        } else if (ff_osd_y != 0) {
             /* Character Data. */
             i2c_display.text[ff_osd_y-1][ff_osd_x] = x;
             if (++ff_osd_x >= i2c_display.cols) {
@@ -150,6 +241,15 @@ static void ff_osd_process(void)
                 i2c_display.cols = min_t(uint16_t, 40, x & 0x3f);
             } else {
                 switch (x & 0xf0) {
+                case OSD_CURSOR:
+                    ff_osd_ext.y = x & 0x03;
+                    /* fall through */
+                case OSD_RUN:
+                case OSD_REPEAT:
+                    ff_osd_ext.cmd = x & 0xf0;
+                    ff_osd_ext.have_len = FALSE;
+                    ff_osd_ext.active = TRUE;
+                    break;
                 case OSD_BUTTONS:
                     i2c_buttons_rx = x & 0x0f;
                     break;
@@ -178,8 +278,8 @@ static void ff_osd_process(void)
         }
     }
 
-    d_cons = d_c;
-    t_cons = t_c;
+    r->d_cons = d_c;
+    r->t_cons = t_c;
 }
 
 static void lcd_process_cmd(uint8_t cmd)
@@ -198,8 +298,11 @@ static void lcd_process_cmd(uint8_t cmd)
     switch (c) {
     case 0: /* Set DDR Address */
         lcd_ddraddr = cmd & 127;
+        lcd_cgram = FALSE;
         break;
     case 1: /* Set CGR Address */
+        lcd_cgaddr = cmd & 63;
+        lcd_cgram = TRUE;
         break;
     case 2: /* Function Set */
         break;
@@ -212,10 +315,12 @@ static void lcd_process_cmd(uint8_t cmd)
         break;
     case 6: /* Return Home */
         lcd_ddraddr = 0;
+        lcd_cgram = FALSE;
         break;
     case 7: /* Clear Display */
         memset(i2c_display.text, ' ', sizeof(i2c_display.text));
         lcd_ddraddr = 0;
+        lcd_cgram = FALSE;
         break;
     }
 }
@@ -223,6 +328,11 @@ static void lcd_process_cmd(uint8_t cmd)
 static void lcd_process_dat(uint8_t dat)
 {
     int x, y;
+    if (lcd_cgram) {
+        i2c_display.cgram[lcd_cgaddr >> 3][lcd_cgaddr & 7] = dat & 0x1f;
+        lcd_cgaddr = (lcd_cgaddr + 1) & 63;
+        return;
+    }
     if (lcd_ddraddr >= 0x68)
         lcd_ddraddr = 0x00; /* jump to line 2 */
     if ((lcd_ddraddr >= 0x28) && (lcd_ddraddr < 0x40))
@@ -236,18 +346,23 @@ static void lcd_process_dat(uint8_t dat)
     i2c_display.text[y][x] = dat;
     lcd_ddraddr++;
     if (x >= i2c_display.cols)
-        i2c_display.cols = 16; // min_t(unsigned int, x+1, config.max_cols); changed by Frank 4-11-2024
+        i2c_display.cols = min_t(unsigned int, x+1, 40);
 }
 
 static void lcd_process(void)
 {
-    uint16_t d_c, d_p = d_prod;
+    struct i2c_ring *r = &lcd_ring;
+    uint16_t d_c, d_p = r->d_prod;
     static uint16_t dat = 1;
     static bool_t rs;
-    
+
+    /* The HD44780 stream is stateful across transactions: we consume every
+     * byte and have no use for the transaction ring. */
+    r->t_cons = r->t_prod;
+
     /* Process the command sequence. */
-    for (d_c = d_cons; d_c != d_p; d_c++) {
-        uint8_t x = d_ring[MASK(d_ring, d_c)];
+    for (d_c = r->d_cons; d_c != d_p; d_c++) {
+        uint8_t x = r->d[MASK(r->d, d_c)];
         if ((x & (_EN|_RW)) != _EN)
             continue;
         i2c_display.on = !!(x & _BL);
@@ -266,21 +381,35 @@ static void lcd_process(void)
         }
     }
 
-    d_cons = d_c;
+    r->d_cons = d_c;
+}
+
+/* Update the ST machine state reported to the host. The update is atomic
+ * with respect to the I2C ISR's snapshot of i2c_osd_info. */
+void i2c_osd_update_st(const struct i2c_osd_st_state *st)
+{
+    uint32_t oldpri;
+
+    if (!memcmp(&i2c_osd_info.st, st, sizeof(*st)))
+        return;
+
+    oldpri = IRQ_save(I2C_IRQ_PRI);
+    i2c_osd_info.st = *st;
+    i2c_osd_info.event_seq++;
+    IRQ_restore(oldpri);
 }
 
 void i2c_process(void)
 {
-    return i2c_osd_protocol ? ff_osd_process() : lcd_process();
+    lcd_process();
+    ff_osd_process();
 }
 
 void i2c_init(void)
 {
     char *p;
 
-    i2c_osd_protocol = gpio_pins_connected(gpioa, 0, gpioa, 1);
-
-    i2c_osd_info.protocol_ver = 0;
+    i2c_osd_info.protocol_ver = FF_OSD_PROTOCOL_VER;
     i2c_osd_info.fw_major = strtol(fw_ver, &p, 10);
     i2c_osd_info.fw_minor = strtol(p+1, NULL, 10);
 
@@ -301,7 +430,8 @@ void i2c_init(void)
 
     /* Initialise I2C. */
     i2c->cr1 = 0;
-    i2c->oar1 = (i2c_osd_protocol ? 0x10 : 0x27) << 1;
+    i2c->oar1 = LCD_ADDR << 1;
+    i2c->oar2 = (FF_OSD_ADDR << 1) | I2C_OAR2_ENDUAL;
     i2c->cr2 = (I2C_CR2_FREQ(36) |
                 I2C_CR2_ITERREN |
                 I2C_CR2_ITEVTEN |
@@ -9,9 +9,27 @@
 #define _RW (1u<<1)
 #define _RS (1u<<0)
 
+#include "font.h"
+
 static uint8_t bl_on = 0x00;
 
-const uint8_t i2c_slave_addr = 0x27;
+/* LCD geometry, from the configuration. */
+uint8_t lcd_cols = 16, lcd_rows = 2;
+
+/* I2C address of the display: PCF8574 LCD backpack or SSD1306/SH1106 OLED. */
+static uint8_t i2c_slave_addr = 0x27;
+static bool_t is_oled;
+
+/* The 8 CGRAM slots, managed as a cache of glyph bitmaps. A slot is reused
+ * for a new glyph only if it was not used in the frame being composed, so
+ * nothing on screen changes under our feet. */
+static struct glyph {
+    uint8_t bits[8];
+    uint32_t used;  /* frame in which last used */
+    bool_t valid;
+    bool_t loaded;  /* bitmap is in the controller's CGRAM */
+} glyphs[8];
+static uint32_t glyph_frame = 1;
 
 /* STM32 I2C peripheral. */
 static volatile struct i2c *i2c = i2c2;
@@ -33,12 +51,28 @@ const static struct i2c_cfg {
 #define SCL2 i2c_cfg->scl
 #define SDA2 i2c_cfg->sda
 
+/* Bus speed: Fast mode (400kHz) unless the display can't keep up, in which
+ * case we drop to Standard mode (100kHz) until next reset. Each NACK, bus
+ * error or lost arbitration adds FM_ERR_COST to fm_score, and each good
+ * transaction takes one away: an error rate above 1 in FM_ERR_COST, or a
+ * burst of FM_ERR_LIMIT/FM_ERR_COST errors, forces the step down. */
+#define FM_ERR_COST  16
+#define FM_ERR_LIMIT 64
+static bool_t i2c_fast = TRUE;
+static volatile uint8_t fm_score;
+
+/* SR1 error flags seen since the last failure was accounted. */
+static volatile uint16_t i2c_err_flags;
+
+struct lcd_stats lcd_stats;
+
 /* Wait for given status condition @s while also checking for errors. */
 static bool_t i2c_wait(uint8_t s)
 {
     stk_time_t t = stk_now();
     while ((i2c->sr1 & s) != s) {
         if (i2c->sr1 & I2C_SR1_ERRORS) {
+            i2c_err_flags |= i2c->sr1 & I2C_SR1_ERRORS;
             i2c->sr1 &= ~I2C_SR1_ERRORS;
             return FALSE;
         }
@@ -66,11 +100,15 @@ static bool_t i2c_start(uint8_t a, bool_t rd)
 }
 
 /* Synchronously transmit the I2C STOP sequence. */
-static void i2c_stop(void)
+static bool_t i2c_stop(void)
 {
+    stk_time_t t = stk_now();
     i2c->cr1 |= I2C_CR1_STOP;
-    while (i2c->cr1 & I2C_CR1_STOP)
-        continue;
+    while (i2c->cr1 & I2C_CR1_STOP) {
+        if (stk_diff(t, stk_now()) > stk_ms(10))
+            return FALSE;
+    }
+    return TRUE;
 }
 
 /* Synchronously transmit an I2C byte. */
@@ -80,30 +118,542 @@ static bool_t i2c_sync_write(uint8_t b)
     return i2c_wait(I2C_SR1_BTF); // Byte transfer finished
 }
 
-/* Write a 4-bit nibble over D7-D4 (4-bit bus). */
-static void write4(uint8_t val)
+/* Last byte written to the PCF8574 in this transaction. */
+static uint8_t pcf_last;
+
+/* Write a 4-bit nibble over D7-D4 (4-bit bus). The HD44780 latches D7-D4 on
+ * the falling edge of EN, so data need only be valid while EN is high and
+ * the EN-low byte ending one nibble can also set up the next. Only RS (and
+ * RW) must settle before EN rises, so a setup byte is needed only when those
+ * change: 4 bytes per character instead of 6. */
+static bool_t write4(uint8_t val)
 {
-    i2c_sync_write(val);
-    i2c_sync_write(val | _EN);
-    i2c_sync_write(val);
+    bool_t setup = ((val ^ pcf_last) & (_BL|_RW|_RS)) != 0;
+    pcf_last = val;
+    return (!setup || i2c_sync_write(val))
+        && i2c_sync_write(val | _EN)
+        && i2c_sync_write(val);
 }
 
-static void writeNibbles(uint8_t val, uint8_t signals)
+static bool_t writeNibbles(uint8_t val, uint8_t signals)
 {
-    write4((val & 0xf0) | signals);
-    write4((val << 4) | signals);
+    return write4((val & 0xf0) | signals)
+        && write4((val << 4) | signals);
 }
 
-static void writeText(uint8_t *text, uint8_t len, uint8_t signals)
+static bool_t writeText(uint8_t *text, uint8_t len, uint8_t signals)
 {
     for(uint8_t i = 0 ; i < len ; i++) {
-        write4((text[i] & 0xf0) | signals);
-        write4((text[i] << 4) | signals);
+        if (!writeNibbles(text[i], signals))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Fast Mode (400kHz) or Standard Mode (100kHz) master, as per i2c_fast.
+ * Also resets the peripheral. */
+static void i2c_setup(void)
+{
+    i2c->cr1 = I2C_CR1_SWRST;
+    i2c->cr1 = 0;
+    i2c->cr2 = I2C_CR2_FREQ(36);  // set Peripheral clock frequency
+    if (i2c_fast) {
+        /* 36MHz / (3 * 30) = 400kHz, Tlow/Thigh = 2 (DUTY=0) */
+        i2c->ccr = I2C_CCR_FS | I2C_CCR_CCR(30);
+        i2c->trise = 11;          // 300ns max rise time: 36MHz * 300ns + 1
+    } else {
+        /* 36MHz / (2 * 180) = 100kHz */
+        i2c->ccr = I2C_CCR_CCR(180);
+        i2c->trise = 37;          // 1000ns max rise time: 36MHz * 1us + 1
+    }
+    i2c->cr1 = I2C_CR1_PE;        // Enable Peripheral
+    lcd_stats.bus_khz = i2c_fast ? 400 : 100;
+}
+
+/* Free a bus held by a slave which is stuck mid-byte with SDA low: clock SCL
+ * by hand until it lets go (at most 9 clocks), then issue a STOP. */
+static void i2c_unstick(void)
+{
+    unsigned int i;
+
+    i2c->cr1 = 0;
+    gpio_configure_pin(gpiob, SDA2, GPO_opendrain(_2MHz, HIGH));
+    gpio_configure_pin(gpiob, SCL2, GPO_opendrain(_2MHz, HIGH));
+    delay_us(10);
+
+    for (i = 0; (i < 9) && !gpio_read_pin(gpiob, SDA2); i++) {
+        gpio_write_pin(gpiob, SCL2, LOW);
+        delay_us(5);
+        gpio_write_pin(gpiob, SCL2, HIGH);
+        delay_us(5);
+    }
+
+    /* STOP: SDA rises while SCL is high. */
+    gpio_write_pin(gpiob, SCL2, LOW);
+    delay_us(5);
+    gpio_write_pin(gpiob, SDA2, LOW);
+    delay_us(5);
+    gpio_write_pin(gpiob, SCL2, HIGH);
+    delay_us(5);
+    gpio_write_pin(gpiob, SDA2, HIGH);
+    delay_us(5);
+
+    gpio_configure_pin(gpiob, SCL2, AFO_opendrain(_2MHz));
+    gpio_configure_pin(gpiob, SDA2, AFO_opendrain(_2MHz));
+}
+
+/* Begin a write transaction to the display. */
+static bool_t lcd_begin(void)
+{
+    pcf_last = 0xff; /* unknown: force a setup byte */
+    i2c->cr1 |= I2C_CR1_START; // generate a Start condition
+    return i2c_start(i2c_slave_addr, I2C_WR);
+}
+
+/* Probe for a device at address @a. */
+static bool_t i2c_probe(uint8_t a)
+{
+    bool_t ok;
+    i2c->cr1 |= I2C_CR1_START; // generate a Start condition
+    ok = i2c_start(a, I2C_WR);
+    return i2c_stop() && ok;
+}
+
+/*
+ * 128x64 OLED (SSD1306 or SH1106), shown as 4 rows of 16 double-height
+ * characters from the 8x8 font. Rendering happens into a framebuffer, with
+ * the changed span of each 8-pixel page tracked as dirty. Dirty spans are
+ * pushed to the display by the I2C2 interrupt handlers, so the main loop
+ * never waits on the bus. (DMA1 channel 4, which serves I2C2 TX, is owned
+ * by the console.)
+ */
+
+#define OLED_PAGES 8
+#define OLED_WIDTH 128
+
+static uint8_t oled_fb[OLED_PAGES][OLED_WIDTH];
+static uint8_t oled_dirty_x0[OLED_PAGES], oled_dirty_x1[OLED_PAGES];
+static bool_t oled_sh1106;
+
+/* Display On/Off command awaiting transmission, or 0. */
+static uint8_t oled_display_cmd;
+
+/* Transaction currently being transmitted by the ISRs. */
+static uint8_t oled_tx[7 + OLED_WIDTH];
+static uint8_t oled_tx_len, oled_tx_pos;
+static volatile bool_t oled_busy, oled_failed;
+static stk_time_t oled_tx_start;
+
+static const uint8_t ssd1306_init_cmds[] = {
+    0xae,       /* display off */
+    0xd5, 0x80, /* clock divide */
+    0xa8, 0x3f, /* multiplex ratio: 64 */
+    0xd3, 0x00, /* display offset */
+    0x40,       /* start line 0 */
+    0x8d, 0x14, /* charge pump on */
+    0x20, 0x02, /* page addressing mode */
+    0xa1, 0xc8, /* segment remap, COM scan direction */
+    0xda, 0x12, /* COM pins */
+    0x81, 0xcf, /* contrast */
+    0xd9, 0xf1, /* pre-charge */
+    0xdb, 0x40, /* VCOMH deselect */
+    0xa4, 0xa6, /* display from RAM, non-inverted */
+    0xaf        /* display on */
+};
+
+static const uint8_t sh1106_init_cmds[] = {
+    0xae,       /* display off */
+    0xd5, 0x80, /* clock divide */
+    0xa8, 0x3f, /* multiplex ratio: 64 */
+    0xd3, 0x00, /* display offset */
+    0x40,       /* start line 0 */
+    0xad, 0x8b, /* DC-DC on */
+    0xa1, 0xc8, /* segment remap, COM scan direction */
+    0xda, 0x12, /* COM pins */
+    0x81, 0xcf, /* contrast */
+    0xd9, 0x1f, /* pre-charge */
+    0xdb, 0x40, /* VCOMH deselect */
+    0xa4, 0xa6, /* display from RAM, non-inverted */
+    0xaf        /* display on */
+};
+
+/* Build the next transaction into oled_tx[]. Returns FALSE if idle. */
+static bool_t oled_prep_tx(void)
+{
+    uint8_t p, x0, x1, c;
+
+    if (oled_display_cmd) {
+        oled_tx[0] = 0x00; /* command stream */
+        oled_tx[1] = oled_display_cmd;
+        oled_tx_len = 2;
+        oled_display_cmd = 0;
+        return TRUE;
+    }
+
+    for (p = 0; p < OLED_PAGES; p++)
+        if (oled_dirty_x0[p] < oled_dirty_x1[p])
+            break;
+    if (p == OLED_PAGES)
+        return FALSE;
+
+    x0 = oled_dirty_x0[p];
+    x1 = oled_dirty_x1[p];
+    oled_dirty_x0[p] = OLED_WIDTH;
+    oled_dirty_x1[p] = 0;
+
+    /* SH1106 has a 132-column RAM with the panel centred in it. */
+    c = x0 + (oled_sh1106 ? 2 : 0);
+    oled_tx[0] = 0x80; oled_tx[1] = 0xb0 | p;       /* page */
+    oled_tx[2] = 0x80; oled_tx[3] = 0x00 | (c & 15); /* column low */
+    oled_tx[4] = 0x80; oled_tx[5] = 0x10 | (c >> 4); /* column high */
+    oled_tx[6] = 0x40; /* data stream */
+    memcpy(&oled_tx[7], &oled_fb[p][x0], x1 - x0);
+    oled_tx_len = 7 + x1 - x0;
+    return TRUE;
+}
+
+/* Start the next transaction, if the bus is idle and there is work to do.
+ * Called with the I2C2 IRQs masked. CR1 must not be written while the STOP
+ * of the last transaction is pending, so until that has gone out and the
+ * bus is free we leave the work for the next call from lcd_ready(). */
+static void oled_kick(void)
+{
+    if (oled_busy || (i2c->cr1 & I2C_CR1_STOP)
+        || (i2c->sr2 & I2C_SR2_BUSY) || !oled_prep_tx())
+        return;
+    oled_busy = TRUE;
+    oled_tx_start = stk_now();
+    oled_tx_pos = 0;
+    i2c->cr2 |= I2C_CR2_ITBUFEN;
+    i2c->cr1 |= I2C_CR1_START;
+}
+
+static void IRQ_oled_event(void)
+{
+    uint16_t sr1 = i2c->sr1;
+
+    if (sr1 & I2C_SR1_SB) {
+        /* Write DR clears SR1_SB. */
+        i2c->dr = i2c_slave_addr << 1;
+    }
+
+    if (sr1 & I2C_SR1_ADDR) {
+        /* Read SR2 clears SR1_ADDR. */
+        (void)i2c->sr2;
+    }
+
+    if ((sr1 & I2C_SR1_TXE) && (oled_tx_pos < oled_tx_len)) {
+        i2c->dr = oled_tx[oled_tx_pos++];
+        if (oled_tx_pos == oled_tx_len) {
+            /* Last byte: now wait for BTF only. */
+            i2c->cr2 &= ~I2C_CR2_ITBUFEN;
+        }
+    } else if ((sr1 & I2C_SR1_BTF) && oled_busy
+               && (oled_tx_pos == oled_tx_len)) {
+        /* Don't wait for the STOP here: oled_kick() does. BTF stays set
+         * until the STOP goes out, so only request it once. */
+        i2c->cr1 |= I2C_CR1_STOP;
+        if (fm_score)
+            fm_score--;
+        oled_busy = FALSE;
+    }
+}
+
+static void IRQ_oled_error(void)
+{
+    /* Abandon the transaction and leave the bus alone. The main loop
+     * notices oled_failed and recovers the bus, then redraws. */
+    i2c_err_flags |= i2c->sr1 & I2C_SR1_ERRORS;
+    i2c->sr1 &= ~I2C_SR1_ERRORS;
+    i2c->cr2 &= ~(I2C_CR2_ITBUFEN | I2C_CR2_ITEVTEN | I2C_CR2_ITERREN);
+    oled_failed = TRUE;
+}
+
+void IRQ_33(void) __attribute__((alias("IRQ_oled_event")));
+void IRQ_34(void) __attribute__((alias("IRQ_oled_error")));
+
+static void oled_mark_dirty(uint8_t p, uint8_t x0, uint8_t x1)
+{
+    uint32_t oldpri = IRQ_save(LCD_IRQ_PRI);
+    oled_dirty_x0[p] = min(oled_dirty_x0[p], x0);
+    oled_dirty_x1[p] = max(oled_dirty_x1[p], x1);
+    oled_kick();
+    IRQ_restore(oldpri);
+}
+
+/* Render up to 16 characters as double-height glyphs into text row @row. */
+static void oled_refresh(const uint8_t *text, uint8_t row, uint8_t len)
+{
+    uint8_t *top = oled_fb[row*2], *bot = oled_fb[row*2+1];
+    uint8_t i, x, y, c, x0 = OLED_WIDTH, x1 = 0;
+    const uint8_t *g;
+
+    len = min_t(uint8_t, len, OLED_WIDTH/8);
+    for (i = 0; i < len; i++) {
+        c = text[i];
+        if (c < 8) {
+            /* 5x8 CGRAM glyph, centred in the 8x8 cell. */
+            g = glyphs[c].bits;
+            c = 2;
+        } else {
+            if ((c < 0x20) || (c >= 0x20 + sizeof(font)/8))
+                c = ' ';
+            g = &font[(c - 0x20) * 8];
+            c = 0;
+        }
+        for (x = 0; x < 8; x++) {
+            /* Each column of the glyph becomes 16 vertical pixels. */
+            uint16_t col = 0;
+            uint8_t px = i*8 + x;
+            for (y = 0; y < 8; y++)
+                if ((g[y] << c) & (0x80 >> x))
+                    col |= 3u << (y*2);
+            if ((top[px] == (uint8_t)col) && (bot[px] == (col >> 8)))
+                continue;
+            top[px] = col;
+            bot[px] = col >> 8;
+            x0 = min(x0, px);
+            x1 = max(x1, (uint8_t)(px+1));
+        }
+    }
+
+    if (x0 < x1) {
+        oled_mark_dirty(row*2, x0, x1);
+        oled_mark_dirty(row*2+1, x0, x1);
+    }
+}
+
+static void oled_backlight(int on)
+{
+    uint32_t oldpri = IRQ_save(LCD_IRQ_PRI);
+    oled_display_cmd = on ? 0xaf : 0xae;
+    oled_kick();
+    IRQ_restore(oldpri);
+}
+
+static bool_t oled_init(void)
+{
+    const uint8_t *cmds = oled_sh1106 ? sh1106_init_cmds : ssd1306_init_cmds;
+    unsigned int i, n = (oled_sh1106 ? sizeof(sh1106_init_cmds)
+                         : sizeof(ssd1306_init_cmds));
+
+    oled_busy = oled_failed = FALSE;
+    oled_display_cmd = 0;
+
+    if (!lcd_begin() || !i2c_sync_write(0x00)) /* command stream */
+        return FALSE;
+    for (i = 0; i < n; i++)
+        if (!i2c_sync_write(cmds[i]))
+            return FALSE;
+    if (!i2c_stop())
+        return FALSE;
+
+    lcd_cols = OLED_WIDTH/8;
+    lcd_rows = 4;
+
+    /* Redraw the whole display from the framebuffer. */
+    memset(oled_dirty_x0, 0, sizeof(oled_dirty_x0));
+    memset(oled_dirty_x1, OLED_WIDTH, sizeof(oled_dirty_x1));
+
+    /* From here on the display is driven from the I2C2 interrupts. */
+    IRQx_set_prio(i2c_cfg->event_irq, LCD_IRQ_PRI);
+    IRQx_clear_pending(i2c_cfg->event_irq);
+    IRQx_enable(i2c_cfg->event_irq);
+    IRQx_set_prio(i2c_cfg->error_irq, LCD_IRQ_PRI);
+    IRQx_clear_pending(i2c_cfg->error_irq);
+    IRQx_enable(i2c_cfg->error_irq);
+    i2c->cr2 |= I2C_CR2_ITEVTEN | I2C_CR2_ITERREN;
+
+    oled_backlight(bl_on); /* kicks off the redraw */
+    return TRUE;
+}
+
+/* HD44780 DDRAM address of the start of each row. 4-row panels are
+ * 2-row controllers with each line folded in half. */
+static uint8_t lcd_row_addr(uint8_t row)
+{
+    return ((row & 1) ? 0x40 : 0x00) + ((row & 2) ? lcd_cols : 0);
+}
+
+/* Initialise the HD44780 (or OLED) controller, using the datasheet's
+ * initialisation by instruction so that we resynchronise to 4-bit mode
+ * whatever state the controller was left in. */
+static bool_t lcd_controller_init(void)
+{
+    unsigned int i;
+    bool_t ok;
+
+    /* Be sure CGRAM matches the cache, whatever state it was left in. */
+    for (i = 0; i < ARRAY_SIZE(glyphs); i++)
+        glyphs[i].loaded = FALSE;
+
+    if (is_oled)
+        return oled_init();
+
+    /* The datasheet wants >4.1ms after the first Function Set and >100us
+     * after the second: at 400kHz the next nibble follows in only 45us. */
+    ok = lcd_begin()
+        && write4(0x30)                 /* 8bit mode */
+        && (delay_ms(5), write4(0x30))  /* 8bit mode */
+        && (delay_us(100), write4(0x30)) /* 8bit mode */
+        && write4(0x20)                 /* 4bit mode */
+        && writeNibbles (0x28, 0)       /* 4bit mode, 2 lines (also for 4-row LCDs) */
+        && writeNibbles (bl_on ? 0x0C : 0x08, bl_on) /* Display ON/OFF Cursor OFF */
+        && writeNibbles (0x06, bl_on)   /* Auto Increment cursor */
+        && writeNibbles (0x01, bl_on)   /* clear display */
+        && i2c_stop();
+
+    delay_ms(5);
+
+    return ok;
+}
+
+/*
+ * Bus health. After an error we stop using the bus for a while, backing off
+ * exponentially while errors persist. When the backoff period has passed we
+ * unstick and reset the bus, and reinitialise the display, at most once per
+ * period. Callers therefore never wait out more than one bus timeout in a
+ * row.
+ */
+#define BACKOFF_MAX 6 /* 10ms << 6 = 640ms, inside the 1.86s SysTick wrap */
+static struct {
+    bool_t failed;
+    uint8_t backoff;
+    stk_time_t since;
+} bus;
+
+static void fm_account(bool_t err)
+{
+    uint32_t oldpri;
+
+    if (!i2c_fast)
+        return;
+
+    oldpri = IRQ_save(LCD_IRQ_PRI);
+    if (err)
+        fm_score += FM_ERR_COST;
+    else if (fm_score)
+        fm_score--;
+    IRQ_restore(oldpri);
+
+    if (fm_score >= FM_ERR_LIMIT) {
+        /* Takes effect when the bus is next set up, i.e. on recovery. */
+        i2c_fast = FALSE;
+        logk("LCD: Too many I2C errors, falling back to 100kHz\n");
     }
 }
 
+static void bus_fail(void)
+{
+    fm_account(!!(i2c_err_flags & (I2C_SR1_AF | I2C_SR1_BERR
+                                   | I2C_SR1_ARLO)));
+    i2c_err_flags = 0;
+
+    lcd_stats.errors++;
+    if (!bus.failed) {
+        bus.failed = TRUE;
+        bus.backoff = 0;
+    } else if (bus.backoff < BACKOFF_MAX) {
+        bus.backoff++;
+    }
+    bus.since = stk_now();
+}
+
+static bool_t bus_recover(void)
+{
+    i2c_unstick();
+    i2c_setup();
+
+    if (!lcd_controller_init()) {
+        bus_fail();
+        return FALSE;
+    }
+
+    bus.failed = FALSE;
+    lcd_stats.recoveries++;
+    logk("LCD: I2C bus recovered after %u errors\n", lcd_stats.errors);
+    display_invalidate();
+    return TRUE;
+}
+
+/* The last slow HD44780 command: when it was sent, and how long it takes. */
+static struct {
+    stk_time_t since;
+    unsigned int ticks;
+} lcd_exec;
+
+/* Is the bus usable right now? Attempts recovery when it is due. */
+bool_t lcd_ready(void)
+{
+    if (is_oled && !bus.failed
+        && (oled_failed || (oled_busy && (stk_timesince(oled_tx_start)
+                                          > stk_ms(10))))) {
+        /* The interrupt-driven transfer failed or has stalled. */
+        i2c->cr2 &= ~(I2C_CR2_ITBUFEN | I2C_CR2_ITEVTEN | I2C_CR2_ITERREN);
+        bus_fail();
+    }
+
+    if (!bus.failed) {
+        if (lcd_exec.ticks) {
+            /* Still executing a slow command: see lcd_command(). */
+            if (stk_timesince(lcd_exec.since) < lcd_exec.ticks)
+                return FALSE;
+            lcd_exec.ticks = 0;
+        }
+        if (is_oled && !oled_busy) {
+            /* Start the next transaction, now the last STOP is done. */
+            uint32_t oldpri = IRQ_save(LCD_IRQ_PRI);
+            oled_kick();
+            IRQ_restore(oldpri);
+        }
+        return TRUE;
+    }
+
+    if (stk_timesince(bus.since) < stk_ms(10 << bus.backoff))
+        return FALSE;
+
+    return bus_recover();
+}
+
+/* End a write transaction to the display which went @ok so far. */
+static bool_t lcd_end(bool_t ok)
+{
+    if (ok && i2c_stop()) {
+        fm_account(FALSE);
+        return TRUE;
+    }
+    bus_fail();
+    return FALSE;
+}
+
+/* Find the display: an LCD backpack, else an OLED. */
+static bool_t lcd_find(void)
+{
+    if (i2c_probe(i2c_slave_addr))
+        return TRUE;
+
+    if (i2c_probe(0x3c))
+        i2c_slave_addr = 0x3c;
+    else if (i2c_probe(0x3d))
+        i2c_slave_addr = 0x3d;
+    else
+        return FALSE;
+
+    is_oled = TRUE;
+    oled_sh1106 = config.sh1106;
+    printk("OLED %s at 0x%02x\n",
+           oled_sh1106 ? "SH1106" : "SSD1306", i2c_slave_addr);
+    return TRUE;
+}
+
 bool_t lcd_init(void)
 {
+    if ((config.lcd_cols == 16) || (config.lcd_cols == 20)
+        || (config.lcd_cols == 40))
+        lcd_cols = config.lcd_cols;
+    lcd_rows = ((config.lcd_rows == 4) && (lcd_cols <= 20)) ? 4 : 2;
+    bl_on = 0x08;
+
     i2c = i2c2;
     i2c_cfg = &i2c2_cfg;
     rcc->apb1enr |= 1<<i2c_cfg->en;
@@ -111,56 +661,134 @@ bool_t lcd_init(void)
     gpio_configure_pin(gpiob, SCL2, AFO_opendrain(_2MHz));
     gpio_configure_pin(gpiob, SDA2, AFO_opendrain(_2MHz));
 
-    /* Standard Mode (100kHz) */
-    i2c->cr1 = 0;
-    i2c->cr2 = I2C_CR2_FREQ(36);  // set Peripheral clock frequency
-    i2c->ccr = I2C_CCR_CCR(180);  // set Clock control register 
-    i2c->trise = 37;		  // Maximum rise time in Fm/Sm mode (Master mode)
-    i2c->cr1 = I2C_CR1_PE;        // Enable Peripheral
+    /* Find the display, in Standard mode if it doesn't answer in Fast. */
+    i2c_setup();
+    if (!lcd_find()) {
+        i2c_fast = FALSE;
+        i2c_unstick();
+        i2c_setup();
+        if (!lcd_find())
+            goto fail;
+    }
 
-    i2c->cr1 |= I2C_CR1_START; // generate a Start condition
-    if (!i2c_start(i2c_slave_addr, I2C_WR))
+    /* Probes of absent addresses NACK: don't count those against us. */
+    i2c_err_flags = 0;
+
+    if (!lcd_controller_init())
         goto fail;
 
-    writeNibbles (0x02, 0);       /* 4bit mode */
-    writeNibbles (0x28, 0);       /* Initialization of 16X2 LCD in 4bit mode */
-    bl_on = 0x08;
-    writeNibbles (0x0C, bl_on); /* Display ON Cursor OFF */
-    writeNibbles (0x06, bl_on); /* Auto Increment cursor */
-    writeNibbles (0x01, bl_on); /* clear display */
-    
-    i2c_stop();
-    
-    delay_ms(5);
-    
+    printk("LCD: I2C at %ukHz\n", lcd_stats.bus_khz);
     return TRUE;
 
 fail:
     printk("i2c error!\n\n");
+    bus_fail();
     return FALSE;
 }
 
-void lcd_refresh(uint8_t *text, uint8_t ruleNr)
+void lcd_glyph_frame(void)
 {
-    i2c->cr1 |= I2C_CR1_START; // generate a Start condition
-    if (!i2c_start(i2c_slave_addr, I2C_WR))
-        goto fail;
-        
-    if(!ruleNr) {
-    	writeNibbles (0x80, bl_on);       /* cursor at home position 1st line */
-    } else {
-        writeNibbles (0xC0, bl_on);       /* cursor at home position 2nd line */
+    glyph_frame++;
+}
+
+int lcd_glyph(const uint8_t *bits)
+{
+    struct glyph *g, *victim = NULL;
+
+    for (g = glyphs; g != &glyphs[ARRAY_SIZE(glyphs)]; g++) {
+        if (g->valid && !memcmp(g->bits, bits, sizeof(g->bits))) {
+            g->used = glyph_frame;
+            return g - glyphs;
+        }
+        /* Least recently used. Free slots have never been used (0). */
+        if ((g->used != glyph_frame) && (!victim || (g->used < victim->used)))
+            victim = g;
     }
-    
-    writeText(text, 16, bl_on | _RS);
-    
-    i2c_stop();
-    
+
+    if (!victim)
+        return -1;
+
+    memcpy(victim->bits, bits, sizeof(victim->bits));
+    victim->valid = TRUE;
+    victim->loaded = FALSE;
+    victim->used = glyph_frame;
+    return victim - glyphs;
+}
+
+/* Upload glyphs which have changed since they were last sent to CGRAM. */
+static bool_t lcd_load_glyphs(void)
+{
+    struct glyph *g;
+    bool_t ok;
+
+    for (g = glyphs; g != &glyphs[ARRAY_SIZE(glyphs)]; g++) {
+        if (!g->valid || g->loaded)
+            continue;
+        ok = lcd_begin()
+            && writeNibbles (0x40 | ((g - glyphs) << 3), bl_on) /* Set CGRAM address */
+            && writeText(g->bits, sizeof(g->bits), bl_on | _RS);
+        if (!lcd_end(ok))
+            return FALSE;
+        g->loaded = TRUE;
+    }
+
+    return TRUE;
+}
+
+/* write @len characters of @text to the start of row @ruleNr. @len may exceed
+ * lcd_cols (up to 40 on a 2-row lcd) for use with lcd_shift_left() */
+bool_t lcd_refresh(uint8_t *text, uint8_t ruleNr, uint8_t len)
+{
+    bool_t ok;
+
+    if (!lcd_ready())
+        return FALSE;
+
+    if (is_oled) {
+        oled_refresh(text, ruleNr, len);
+        return TRUE;
+    }
+
+    if (!lcd_load_glyphs())
+        return FALSE;
+
+    ok = lcd_begin()
+        && writeNibbles (0x80 | lcd_row_addr(ruleNr), bl_on) /* cursor at start of the line */
+        && writeText(text, len, bl_on | _RS);
+    if (!lcd_end(ok))
+        return FALSE;
+
     delay_ms(1);
 
-fail:
-    return;
-    // printk("i2c error!\n\n");
+    return TRUE;
+}
+
+/* Send command @cmd, which the controller takes @ticks to execute. Rather
+ * than wait that out, lcd_ready() holds off the next access until then. */
+static bool_t lcd_command(uint8_t cmd, unsigned int ticks)
+{
+    if (!lcd_ready())
+        return FALSE;
+
+    if (!lcd_end(lcd_begin() && writeNibbles (cmd, bl_on)))
+        return FALSE;
+
+    lcd_exec.since = stk_now();
+    lcd_exec.ticks = ticks;
+    return TRUE;
+}
+
+/* shift the whole display one column to the left (all rows move together) */
+bool_t lcd_shift_left(void)
+{
+    /* Cursor or Display Shift: S/C=1, R/L=0 */
+    return lcd_command(0x18, stk_us(40));
+}
+
+/* undo any display shift */
+bool_t lcd_shift_home(void)
+{
+    return lcd_command(0x02, stk_ms(2)); /* Return Home */
 }
 
 bool_t isBacklightOn(void)
@@ -170,19 +798,21 @@ bool_t isBacklightOn(void)
 
 void backlight(int on)
 {
-    i2c->cr1 |= I2C_CR1_START; // generate a Start condition
-    i2c_start(i2c_slave_addr, I2C_WR);
-
-    if(on) {
-        bl_on = 0x08;
-        writeNibbles (0x0C, bl_on); /* display on */
-    } else {
-        bl_on = 0x00;
-        writeNibbles (0x08, bl_on); /* display off */
+    if (!lcd_ready()) {
+        /* remember the new state if the bus is down: recovery applies it.
+         * Otherwise the caller retries once the last command is done. */
+        if (bus.failed)
+            bl_on = on ? 0x08 : 0x00;
+        return;
     }
-        
-    i2c_stop();
+
+    bl_on = on ? 0x08 : 0x00;
+
+    if (is_oled)
+        return oled_backlight(on);
+
+    lcd_end(lcd_begin()
+            && writeNibbles (on ? 0x0C : 0x08, bl_on)); /* display on/off */
     
     delay_ms(1);
 }
-
@@ -35,31 +35,29 @@
 #define gpio_hd_led gpioa	// gpio port for harddisk LED
 #define hd_led_pin 8		// harddisk LED pin
 
-static struct display *cur_display = &i2c_display; // i2c_display is initialized in i2c.c
-static uint8_t notify_text[2][16];       // notifications shown on the lcd display
-static uint8_t notify_time = 0;         // timer value in milliseconds
-static uint8_t current_lcd_text[2][16];  // previous text that was sent to the lcd 
-bool_t was_bl_on;			 // was the backlight on before we showed our notification?
-
-
 /* FlashFloppy and Harddisk states and timers */
 uint8_t HDState = 0;
 uint8_t FFState = 0;
 uint8_t hd_timer = 0;
 uint8_t ff_timer = 0;
 
+/* Atari ST resets since power on, and whether the ST is held in reset */
+static uint16_t reset_count = 0;
+static bool_t in_reset = FALSE;
+
+/* boot drive selected on the boot order pin. Kept here, as PC13 is shared with the Blue Pill LED and can't be trusted when read back */
+static bool_t bootInternal = TRUE;
+
+/* main loop timing */
+struct loop_stats loop_stats;
+
 /* bootup delay */
 uint8_t bootup = 10; // disable read reset line for 1 second from bootup
-uint8_t ld_timer = 5; // let the build in toggle on and off each 0.5 second
-
-/* functions from lcd.c */
-extern void lcd_init(void);
-extern void lcd_refresh(uint8_t *text, uint8_t ruleNr);
-extern bool_t isBacklightOn(void);
-extern void backlight(int on);
-extern uint8_t getFFbuttons(void);
+uint8_t ld_timer = 5; // blink the HD led each 0.5 second in config mode
 
 /* functions from atari.c */
+extern uint8_t getFFbuttons(void);
+extern uint8_t getKeyboardModifiers(void);
 extern void st_init(void);
 extern uint8_t st_check(void);
 
@@ -116,14 +114,8 @@ static void IRQ_default_timer(void)
 
 	tim2->sr &= ~(1<<0); // Clear UIF update interrupt flag
 	
-	/* timeout for the notifications shown */
-	if(notify_time > 0) {
-	    notify_time--;
-	    if(notify_time == 0) {
-	        /* if the backlight was off before the notification then switch it off again */
-	        backlight(was_bl_on);
-            }
-	}
+	/* timeouts of the notifications shown, and scrolling */
+	display_tick();
 	
 	/* before we switch on the FlashFloppy led we will wait a millisecond to filter out very short pulses.*/
 	if(ff_timer > 0) {
@@ -148,8 +140,7 @@ static void IRQ_default_timer(void)
 	
 	ld_timer--;
 	if(ld_timer == 0) {
-	    // Toggle the build in led to indicate that the board is up and running
-	    gpio_write_pin(gpioc, 13, !gpio_read_pin(gpioc, 13));
+	    /* the build in led is on PC13, which is the boot order output, so it can't be used as a heartbeat */
 	    ld_timer = 5;
 	    
 	    if(config_active) {
@@ -161,29 +152,13 @@ static void IRQ_default_timer(void)
     }
 }
 
-/* Show a notification on the LCD screen */
-void notify(char* line1, char* line2)
-{
-    uint8_t len1 = strlen(line1);
-    uint8_t len2 = strlen(line2);
-    
-    /* copy the text of each line to the notify-buffer and add additional spaces */
-    memcpy(&notify_text[0][0], line1, len1);
-    memset(&notify_text[0][len1], ' ', 16-len1);
-    
-    memcpy(&notify_text[1][0], line2, len2);
-    memset(&notify_text[1][len2], ' ', 16-len2);
-    
-    /* set the notification timer */
-    notify_time = 30; // = 3 seconds
-    
-    /* save the current state of the backlight and switch the backlight on */
-    was_bl_on = isBacklightOn();
-    backlight(TRUE);
-}
-
 /* Inside the Atari ST the reset line is normaly high and if pulled low the ST stays in the reset state */
 void holdReset(void) {
+    /* count this reset now, so that the main loop doesn't count it again when it sees the reset line low */
+    if(!in_reset)
+        reset_count++;
+    in_reset = TRUE;
+    
     /* Set the pin as output and pull it low for a while to set the Atari ST in the reset state */
     gpio_configure_pin(gpio_reset, reset_pin, GPO_pushpull(_2MHz, LOW));
 }
@@ -193,11 +168,26 @@ void releaseReset(void) {
     gpio_configure_pin(gpio_reset, reset_pin, GPI_floating);
 }
 
+/* Select TOS bank 0-3 with the sound mode and boot drive of its profile, and hold the ST in reset. The caller releases the reset */
+void selectTOS(uint8_t bank)
+{
+    char text[15] = "Current ROM x:";
+
+    text[12] = bank + 49;
+    notify(text, config.TOStitle[bank]);
+    holdReset();
+    gpio_write_pin(gpio_rom_select, rom_select_low, bank & (1<<0));
+    gpio_write_pin(gpio_rom_select, rom_select_high, bank & (1<<1));
+    /* the sound select pin is an input: its pull-up (stereo) or pull-down (mono) does the selecting */
+    gpio_write_pin(gpio_sound_select, sound_select_pin, !config.sound[bank]);
+    bootInternal = config.boot[bank];
+    gpio_write_pin(gpio_boot_select, boot_order_pin, bootInternal);
+}
+
 /* process the key presses from the Atari ST */
 uint8_t update_st_keys(void)
 {
     uint8_t stKey;	/* key code from the Atari keyboard */
-    char text[15] = "Current ROM x:";
 	
     /* get keypresses from the Atari (when Control and Alternate keys are pressed */
     stKey = st_check();
@@ -219,10 +209,11 @@ uint8_t update_st_keys(void)
        // Enhanced Atari ST upgrades
         case 48: // B --> Boot from internal or external drive
             holdReset();
-            gpio_write_pin(gpio_boot_select, boot_order_pin, !gpio_read_pin(gpio_boot_select, boot_order_pin));
+            bootInternal = !bootInternal;
+            gpio_write_pin(gpio_boot_select, boot_order_pin, bootInternal);
             delay_ms(250);
             releaseReset();
-            if(gpio_read_pin(gpio_boot_select, boot_order_pin)) {
+            if(bootInternal) {
                 notify("> Boot from", "  internal drive");
             } else {
                 notify("> Boot from", "  external drive");
@@ -247,11 +238,7 @@ uint8_t update_st_keys(void)
         case 61: // F3
         case 62: // F4  --> Select a TOS version
             stKey -= 59;
-            text[12] = stKey + 49;
-            notify(text, config.TOStitle[stKey]);
-            holdReset();
-            gpio_write_pin(gpio_rom_select, rom_select_low, stKey & (1<<0));
-            gpio_write_pin(gpio_rom_select, rom_select_high, stKey & (1<<1));
+            selectTOS(stKey);
             delay_ms(250);
             releaseReset();
             break;
@@ -260,38 +247,22 @@ uint8_t update_st_keys(void)
     return stKey; // forward the key to the configuration
 }
 
-/* compares the new and previous lcd lines and updates the lcd display when there are changes */
-void refreshLcdWhenNeeded(uint8_t *text, uint8_t line)
-{
-    /* when the display line is the same as last time then leave this function */
-    if(strncmp((char*)current_lcd_text[line], (char*)text, 16) == 0)
-        return;
-        
-    /* save the new line so that we can compare it later and refresh one line on the lcd */
-    memcpy(&current_lcd_text[line][0], text, 16);
-    lcd_refresh(text, line);
-}
-
-/* called from the main loop, will update the lcd when needed */
-void process_display(void)
+/* report the state of the Atari ST to the FlashFloppy device. called from the main loop */
+void process_st_state(void)
 {
-    if(config_active) {
-        refreshLcdWhenNeeded(config_display.text[0], 0); // first rule on the lcd
-        refreshLcdWhenNeeded(config_display.text[1], 1); // second rule on the lcd
-    } else if(notify_time > 0) { 
-        /* there is a notification to be shown */
-        refreshLcdWhenNeeded(notify_text[0], 0); // first rule on the lcd
-        refreshLcdWhenNeeded(notify_text[1], 1); // second rule on the lcd
-    } else {
-        /* parse through the text received from the FlashFloppy device */
-        refreshLcdWhenNeeded(cur_display->text[1], 0); // first rule on the lcd
-        refreshLcdWhenNeeded(cur_display->text[2], 1); // second rule on the lcd
-        
-        /* parse through the backlight status (on or off) received from the FlashFloppy device */
-        if(cur_display->on != isBacklightOn()) {
-    	    backlight(cur_display->on);
-        }
-    }
+    struct i2c_osd_st_state st;
+    
+    st.tos_bank = gpio_read_pin(gpio_rom_select, rom_select_low)
+        | (gpio_read_pin(gpio_rom_select, rom_select_high) << 1);
+    st.flags = 0;
+    if(gpio_read_pin(gpio_sound_select, sound_select_pin))
+        st.flags |= OSD_ST_STEREO;
+    if(bootInternal)
+        st.flags |= OSD_ST_BOOT_INT;
+    st.kbd_mods = getKeyboardModifiers();
+    st.reset_count = reset_count;
+    
+    i2c_osd_update_st(&st);
 }
 
 /* Function to switch te LEDs on or off */
@@ -381,11 +352,11 @@ void init_gpio(void)
     holdReset();
     gpio_configure_pin(gpio_rom_select, rom_select_low, GPO_pushpull(_2MHz, t & (1<<0)));
     gpio_configure_pin(gpio_rom_select, rom_select_high, GPO_pushpull(_2MHz, t & (1<<1)));
+    /* sound mode and boot drive from the profile of the startup TOS bank */
+    bootInternal = config.boot[t];
+    gpio_configure_pin(gpio_boot_select, boot_order_pin, GPO_pushpull(_2MHz, bootInternal));
+    gpio_configure_pin(gpio_sound_select, sound_select_pin, config.sound[t] ? GPI_pull_down : GPI_pull_up);
     releaseReset();
-
-    gpio_configure_pin(gpio_boot_select, boot_order_pin, GPO_pushpull(_2MHz, HIGH));
-
-    gpio_configure_pin(gpio_sound_select, sound_select_pin, GPI_pull_up);
     // gpio_configure_pin(gpio_reset, reset_pin, GPI_floating);
 
     gpio_configure_pin(gpio_ff_on, ff_on_pin, GPI_pull_down);
@@ -394,14 +365,34 @@ void init_gpio(void)
     gpio_configure_pin(gpio_hd_led, hd_led_pin, GPI_pull_down);
     /* end of enhanced outputs Atari ST */
 
-    /* PC13: Blue Pill Indicator LED (Active Low) */
-    gpio_configure_pin(gpioc, 13, GPO_pushpull(_2MHz, LOW));
+    /* PC13 also drives the Blue Pill Indicator LED (Active Low): it lights when booting from the external drive */
+}
+
+/* Check the firmware against the CRC embedded by scripts/fwcrc.py: it covers
+ * the code and constants, then the load image of the initialised data. */
+static bool_t firmware_check(void)
+{
+    stk_time_t t = stk_now();
+    uint32_t crc;
+    bool_t ok;
+
+    crc32(_stext, (char *)_fw_crc - _stext);
+    crc = crc32_more(_ldat, _edat - _sdat);
+    ok = (crc == *_fw_crc);
+
+    printk("Firmware CRC %08x: %s (%uus)\n", crc, ok ? "OK" : "BAD",
+           stk_diff(t, stk_now()) / STK_MHZ);
+    return ok;
 }
 
 /* main entrance */
 int main(void)
 {
     uint8_t stKey;
+    stk_time_t loop_start, now;
+    uint32_t loop_us;
+    unsigned int n;
+    bool_t fw_ok;
     
     watchdog_init();
 
@@ -415,6 +406,10 @@ int main(void)
     stm32_init();
     //time_init();
     console_init();
+    /* Why did we reset? Report any crash record from the last run. */
+    for (n = 0; !crash_report(n); n++)
+        continue;
+    fw_ok = firmware_check();
     i2c_init();
 
     /* setup Timer 2: psu clockspeed = 72000000 Hz / prescaler 1000 = 72000 Hz. So if we count until 7200 we have 10 Hz or 100 millisecond */
@@ -438,27 +433,51 @@ int main(void)
     
     config_init();
 
+    /* until told otherwise, assume that FlashFloppy drives an lcd with the same geometry as ours */
+    i2c_display.rows = config.lcd_rows;
+
     init_gpio();
     
     st_init();
 
-    lcd_init();
+    display_init();
+    if(!fw_ok)
+        notify("Firmware CRC", "BAD: reflash!");
     
     printk("Main loop:\n\n");
     
+    shell_init();
+    
+    loop_start = stk_now();
     for (;;) {
         watchdog_kick();
         canary_check();
         
+        now = stk_now();
+        loop_us = stk_diff(loop_start, now) / STK_MHZ;
+        loop_start = now;
+        loop_stats.passes++;
+        if(loop_us > loop_stats.max_us)
+            loop_stats.max_us = loop_us;
+        
         process_drives();
         
 	stKey = update_st_keys();
 	
-        config_process(stKey);
+        config_process(stKey, shell_process());
+        fpec_process();
 	
 	if(!bootup && gpio_read_pin(gpio_reset, reset_pin) == LOW) {
-            notify("-- RESET --", "");
+            display_set_row(LAYER_STATUS, lcd_rows-1, GLYPH_RESET " RESET");
+            display_show(LAYER_STATUS, 30);
+            if(!in_reset)
+                reset_count++;
+            in_reset = TRUE;
+	} else {
+	    in_reset = FALSE;
 	}
+	
+	process_st_state();
 		
         i2c_process();
         process_display();
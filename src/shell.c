@@ -0,0 +1,383 @@
+/*
+ * shell.c
+ *
+ * Line-oriented command shell on the serial console.
+ *
+ * Commands run a step at a time from the main loop, printing at most a line
+ * per step and only when the console ring has room for it, so that a command
+ * never holds up the keyboard, I2C or display processing. Keys typed while a
+ * command runs are kept as type-ahead for the next line, shown with the
+ * prompt once the command is done; Enter rings the bell until then.
+ *
+ * Written & released by Frank Beentjes <frankbeen@gmail.com>
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* functions and statistics from main.c and atari.c */
+extern void holdReset(void);
+extern void releaseReset(void);
+extern void selectTOS(uint8_t bank);
+extern uint32_t stKeyBytes, stKeyOverruns;
+
+#define PROMPT "> "
+
+/* Room needed in the console ring before a command step may print. */
+#define STEP_SPACE 128
+
+static char line[64];
+static unsigned int line_len;
+
+#define MAX_ARGS 4
+static char *argv[MAX_ARGS];
+static unsigned int argc;
+
+/* A command step: print at most one line. Returns TRUE when finished. */
+struct cmd {
+    const char *name, *usage;
+    bool_t (*step)(unsigned int n);
+};
+static const struct cmd *running;
+static unsigned int step;
+static stk_time_t step_time;
+
+static bool_t cmd_help(unsigned int n);
+
+static bool_t cmd_status(unsigned int n)
+{
+    const struct i2c_osd_st_state *st = &i2c_osd_info.st;
+
+    switch (n) {
+    case 0:
+        printk("TOS: %u (%s)\n", st->tos_bank+1, config.TOStitle[st->tos_bank]);
+        break;
+    case 1:
+        printk("Sound: %s, Boot: %sternal drive\n",
+               (st->flags & OSD_ST_STEREO) ? "stereo" : "mono",
+               (st->flags & OSD_ST_BOOT_INT) ? "in" : "ex");
+        break;
+    case 2:
+        printk("ST resets: %u\n", st->reset_count);
+        break;
+    case 3:
+        printk("Display: %ux%u%s, FlashFloppy %s\n", lcd_cols, lcd_rows,
+               isBacklightOn() ? "" : " (off)",
+               i2c_osd_protocol ? "OSD" : "LCD");
+        break;
+    default:
+        printk("Config menu: %s\n", config_active ? "active" : "idle");
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static bool_t cmd_stats(unsigned int n)
+{
+    if ((argc > 1) && !strcmp(argv[1], "reset")) {
+        loop_stats.passes = loop_stats.max_us = 0;
+        return TRUE;
+    }
+
+    switch (n) {
+    case 0:
+        printk("Loop: %u passes, longest %uus\n",
+               loop_stats.passes, loop_stats.max_us);
+        break;
+    case 1:
+        printk("LCD I2C: %ukHz, %u errors, %u recoveries\n",
+               lcd_stats.bus_khz, lcd_stats.errors, lcd_stats.recoveries);
+        break;
+    case 2:
+        printk("Keyboard: %u bytes, %u overruns\n",
+               stKeyBytes, stKeyOverruns);
+        break;
+    default:
+        printk("Console: %u bytes dropped, %u received bytes lost\n",
+               console_dropped(), console_rx_lost());
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static bool_t cmd_config(unsigned int n)
+{
+    char s[40];
+    int i;
+
+    if (argc == 1) {
+        /* List all options, one per step. */
+        if (!config_get(n, s, sizeof(s)))
+            return TRUE;
+        printk("%s\n", s);
+        return FALSE;
+    }
+
+    if (!strcmp(argv[1], "save") && (argc == 2)) {
+        if (n == 0)
+            config_save();
+        if (config_saving())
+            return FALSE;
+        printk("Saved\n");
+        return TRUE;
+    }
+
+    if ((argc < 3) || ((i = config_find(argv[2])) < 0)) {
+        printk("Usage: %s\n", running->usage);
+        return TRUE;
+    }
+
+    if (!strcmp(argv[1], "get") && (argc == 3)) {
+        config_get(i, s, sizeof(s));
+        printk("%s\n", s);
+    } else if (!strcmp(argv[1], "set") && (argc == 4)) {
+        if (!config_set(i, argv[3]))
+            printk("Bad value for %s\n", argv[2]);
+    } else {
+        printk("Usage: %s\n", running->usage);
+    }
+    return TRUE;
+}
+
+/* Hold the ST in reset for 250ms without blocking the main loop. */
+static bool_t reset_step(unsigned int n)
+{
+    if (n == 0) {
+        step_time = stk_now();
+        return FALSE;
+    }
+    if (stk_timesince(step_time) < stk_ms(250))
+        return FALSE;
+    releaseReset();
+    return TRUE;
+}
+
+static bool_t cmd_tos(unsigned int n)
+{
+    long bank;
+    char *p;
+
+    if (n == 0) {
+        bank = (argc == 2) ? strtol(argv[1], &p, 10) : 0;
+        if ((bank < 1) || (bank > 4) || *p) {
+            printk("Usage: %s\n", running->usage);
+            return TRUE;
+        }
+        selectTOS(bank-1);
+    }
+    return reset_step(n);
+}
+
+static bool_t cmd_reset(unsigned int n)
+{
+    if (n == 0) {
+        notify("-- RESET --", "");
+        holdReset();
+    }
+    return reset_step(n);
+}
+
+static bool_t cmd_mirror(unsigned int n)
+{
+    if ((argc == 2) && !strcmp(argv[1], "on"))
+        display_mirror = TRUE;
+    else if ((argc == 2) && !strcmp(argv[1], "off"))
+        display_mirror = FALSE;
+    else
+        printk("Mirror: %s\n", display_mirror ? "on" : "off");
+    return TRUE;
+}
+
+static bool_t cmd_baud(unsigned int n)
+{
+    static unsigned int rate;
+    static bool_t flow;
+    char *p;
+
+    if (argc == 1) {
+        rate = console_get_baud(&flow);
+        printk("Console: %u baud%s\n", rate, flow ? ", RTS/CTS" : "");
+        return TRUE;
+    }
+
+    if (n == 0) {
+        rate = console_baud_actual(strtol(argv[1], &p, 10));
+        flow = (argc == 3) && !strcmp(argv[2], "rtscts");
+        if (!rate || *p || ((argc == 3) && !flow) || (argc > 3)) {
+            printk("Usage: %s\n", running->usage);
+            return TRUE;
+        }
+        printk("Switching to %u baud%s\n", rate, flow ? ", RTS/CTS" : "");
+        return FALSE;
+    }
+
+    /* Let everything go out at the old rate first. */
+    if (!console_tx_idle())
+        return FALSE;
+    console_set_baud(rate, flow);
+    return TRUE;
+}
+
+static bool_t cmd_crash(unsigned int n)
+{
+    if ((argc == 2) && !strcmp(argv[1], "clear")) {
+        crash_clear();
+        return TRUE;
+    }
+    return crash_report(n);
+}
+
+static const struct cmd cmds[] = {
+    { "help", "help", cmd_help },
+    { "status", "status", cmd_status },
+    { "stats", "stats [reset]", cmd_stats },
+    { "config", "config [get <opt> | set <opt> <val> | save]", cmd_config },
+    { "tos", "tos <1-4>", cmd_tos },
+    { "reset", "reset", cmd_reset },
+    { "mirror", "mirror [on|off]", cmd_mirror },
+    { "baud", "baud [<1200-2250000> [rtscts]]", cmd_baud },
+    { "crash", "crash [clear]", cmd_crash },
+};
+
+static bool_t cmd_help(unsigned int n)
+{
+    if (n >= ARRAY_SIZE(cmds))
+        return TRUE;
+    printk(" %s\n", cmds[n].usage);
+    return FALSE;
+}
+
+/* Split the line into arguments and look up the command. */
+static void shell_exec(void)
+{
+    char *p = line;
+    unsigned int i;
+
+    line[line_len] = '\0';
+    line_len = 0;
+
+    for (argc = 0; argc < MAX_ARGS; argc++) {
+        while (isspace(*p))
+            *p++ = '\0';
+        if (*p == '\0')
+            break;
+        argv[argc] = p;
+        while (*p && !isspace(*p))
+            p++;
+    }
+
+    if (argc == 0) {
+        printk(PROMPT);
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(cmds); i++) {
+        if (!strcmp(argv[0], cmds[i].name)) {
+            running = &cmds[i];
+            step = 0;
+            return;
+        }
+    }
+
+    printk("Unknown command '%s': try 'help'\n" PROMPT, argv[0]);
+}
+
+void shell_init(void)
+{
+    printk("Type 'help' for console commands\n" PROMPT);
+}
+
+/* Run a step of the command, or abandon it on Ctrl-C. */
+static void shell_step(int c)
+{
+    if (c == 3) {
+        /* Don't leave the ST in reset. */
+        if ((running->step == cmd_tos) || (running->step == cmd_reset))
+            releaseReset();
+        printk("^C\n");
+        running = NULL;
+        line_len = 0;
+    } else if (console_space() >= STEP_SPACE) {
+        if ((*running->step)(step++))
+            running = NULL;
+    }
+    if (!running) {
+        /* Show what was typed ahead. */
+        line[line_len] = '\0';
+        printk(PROMPT "%s", line);
+    }
+}
+
+int shell_process(void)
+{
+    static int prev_c;
+    int c = console_getkey();
+
+    /* The config menu and the arrow keys belong to config_process(). The
+     * command steps regardless, so that tos and reset release the ST. */
+    if (config_active || (c >= CONSOLE_KEY_UP)) {
+        if (running)
+            shell_step(-1);
+        return c;
+    }
+
+    if (running) {
+        shell_step(c);
+        if (c == 3)
+            return -1;
+    }
+
+    if (c < 0)
+        return -1;
+
+    /* Take CR, LF or CR/LF as the end of the line. */
+    if ((c == '\n') && (prev_c == '\r'))
+        c = -1;
+    prev_c = c;
+
+    switch (c) {
+    case -1:
+        break;
+    case '\r':
+    case '\n':
+        if (running) {
+            /* One command at a time. */
+            printk("\a");
+            break;
+        }
+        printk("\n");
+        shell_exec();
+        break;
+    case 8:
+    case 127:
+        if (line_len) {
+            line_len--;
+            if (!running)
+                printk("\b \b");
+        }
+        break;
+    case 3:
+        line_len = 0;
+        printk("^C\n" PROMPT);
+        break;
+    default:
+        if ((c >= 0x20) && (c < 0x7f) && (line_len < sizeof(line)-1)) {
+            line[line_len++] = c;
+            if (!running)
+                printk("%c", c);
+        }
+        break;
+    }
+
+    return -1;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
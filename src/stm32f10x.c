@@ -13,6 +13,126 @@ struct extra_exception_frame {
     uint32_t r4, r5, r6, r7, r8, r9, r10, r11, lr;
 };
 
+/*
+ * Crash record, kept in a .noinit RAM area which survives system and watchdog
+ * resets (but not loss of power): the exception frame, the fault status
+ * registers and a few words from the top of the stack. (The backup registers
+ * would be the obvious place, but this part has only ten of them.)
+ */
+#define CRASH_MAGIC 0xc4a5c4a5
+#define CRASH_STACK 8
+static struct crash_record {
+    uint32_t magic;
+    uint8_t exc, thread, nr_stack;
+    uint32_t frame[8]; /* r0-r3, r12, lr, pc, psr */
+    uint32_t cfsr, hfsr, mmar, bfar;
+    uint32_t stack[CRASH_STACK];
+    uint32_t csum;
+} crash_record __attribute__((section(".noinit")));
+
+static uint32_t reset_flags; /* RCC_CSR at boot */
+
+/* RAM comes up random at power on: don't trust a record without this. */
+static uint32_t crash_csum(void)
+{
+    const uint32_t *p = (const uint32_t *)&crash_record;
+    uint32_t x = 0;
+    while (p != &crash_record.csum)
+        x = (x << 1 | x >> 31) ^ *p++;
+    return x;
+}
+
+static void crash_save(uint8_t exc, bool_t thread,
+                       const struct exception_frame *frame,
+                       const uint32_t *sp, const uint32_t *stacktop)
+{
+    struct crash_record *c = &crash_record;
+    unsigned int i;
+
+    c->exc = exc;
+    c->thread = thread;
+    c->nr_stack = min_t(unsigned int, CRASH_STACK, stacktop - sp);
+    memcpy(c->frame, frame, sizeof(c->frame));
+    c->cfsr = scb->cfsr;
+    c->hfsr = scb->hfsr;
+    c->mmar = scb->mmar;
+    c->bfar = scb->bfar;
+    for (i = 0; i < c->nr_stack; i++)
+        c->stack[i] = sp[i];
+    c->magic = CRASH_MAGIC;
+    c->csum = crash_csum();
+}
+
+void crash_clear(void)
+{
+    crash_record.magic = 0;
+}
+
+static const char *reset_cause(void)
+{
+    if (reset_flags & RCC_CSR_IWDGRSTF)
+        return "Watchdog";
+    if (reset_flags & RCC_CSR_WWDGRSTF)
+        return "Window watchdog";
+    if (reset_flags & RCC_CSR_LPWRRSTF)
+        return "Low power";
+    if (reset_flags & RCC_CSR_SFTRSTF)
+        return "Software";
+    if (reset_flags & RCC_CSR_PORRSTF)
+        return "Power on";
+    if (reset_flags & RCC_CSR_PINRSTF)
+        return "Reset pin";
+    return "Unknown";
+}
+
+bool_t crash_report(unsigned int n)
+{
+    const struct crash_record *c = &crash_record;
+    unsigned int i;
+
+    if (n == 0) {
+        printk("Last reset: %s\n", reset_cause());
+        return FALSE;
+    }
+
+    if ((c->magic != CRASH_MAGIC) || (c->csum != crash_csum())) {
+        printk("No crash record\n");
+        return TRUE;
+    }
+
+    switch (n) {
+    case 1:
+        printk("Crash: %s #%u at PC=%08x (%s)\n",
+               (c->exc < 16) ? "Exception" : "IRQ",
+               (c->exc < 16) ? c->exc : c->exc - 16,
+               c->frame[6], c->thread ? "Thread" : "Handler");
+        return FALSE;
+    case 2:
+    case 3:
+        /* r0-r3, then r12, lr, pc, psr */
+        i = 4*(n-2);
+        printk((n == 2)
+               ? " r0:  %08x   r1:  %08x   r2:  %08x   r3:  %08x\n"
+               : " r12: %08x   lr:  %08x   pc:  %08x   psr: %08x\n",
+               c->frame[i], c->frame[i+1], c->frame[i+2], c->frame[i+3]);
+        return FALSE;
+    case 4:
+        printk(" cfsr: %08x  hfsr: %08x  mmar: %08x  bfar: %08x\n",
+               c->cfsr, c->hfsr, c->mmar, c->bfar);
+        return FALSE;
+    default:
+        /* Stack, 4 words per line. */
+        i = (n - 5) * 4;
+        if (i >= c->nr_stack)
+            return TRUE;
+        printk(" stack:");
+        for (; (i < c->nr_stack) && (i < (n - 4) * 4); i++)
+            printk(" %08x", c->stack[i]);
+        printk("\n");
+        return FALSE;
+    }
+}
+
 void EXC_unexpected(struct extra_exception_frame *extra)
 {
     struct exception_frame *frame;
@@ -23,10 +143,12 @@ void EXC_unexpected(struct extra_exception_frame *extra)
         frame = (struct exception_frame *)read_special(psp);
         psp = (uint32_t)(frame + 1);
         msp = (uint32_t)(extra + 1);
+        crash_save(exc, TRUE, frame, (uint32_t *)psp, _thread_stacktop);
     } else {
         frame = (struct exception_frame *)(extra + 1);
         psp = read_special(psp);
         msp = (uint32_t)(frame + 1);
+        crash_save(exc, FALSE, frame, (uint32_t *)msp, _irq_stacktop);
     }
 
     printk("Unexpected %s #%u at PC=%08x (%s):\n",
@@ -133,7 +255,7 @@ static void peripheral_init(void)
                     RCC_APB2ENR_TIM1EN |
                     RCC_APB2ENR_SPI1EN);
 
-    rcc->ahbenr = RCC_AHBENR_DMA1EN;
+    rcc->ahbenr = RCC_AHBENR_DMA1EN | RCC_AHBENR_CRCEN;
 
     /* Enable SWD, Turn off serial-wire JTAG and reclaim the GPIOs.
      * Amiga keyboard map PB4 (KBCLK) to TIM3,CH1 and use its input filter
@@ -149,6 +271,10 @@ static void peripheral_init(void)
 
 void stm32_init(void)
 {
+    /* Remember why we reset, and clear the flags for next time. */
+    reset_flags = rcc->csr;
+    rcc->csr |= RCC_CSR_RMVF;
+
     exception_init();
     clock_init();
     peripheral_init();
@@ -201,6 +327,106 @@ void fpec_write(const void *data, unsigned int size, uint32_t flash_address)
    }
 }
 
+/* Wait for the FPEC, and clear its status. Returns FALSE on error. */
+static bool_t fpec_wait_ok(void)
+{
+    bool_t ok;
+
+    while (flash->sr & FLASH_SR_BSY)
+        continue;
+    ok = !(flash->sr & (FLASH_SR_WRPRTERR | FLASH_SR_PGERR));
+    fpec_wait_and_clear();
+    return ok;
+}
+
+/* Halfwords programmed per fpec_process() step: about 1ms. */
+#define FPEC_STEP 16
+
+static struct fpec_job *fpec_queue[4];
+static unsigned int fpec_cons, fpec_prod;
+
+void fpec_submit(struct fpec_job *job)
+{
+    ASSERT((fpec_prod - fpec_cons) < ARRAY_SIZE(fpec_queue));
+    job->erased = !job->erase;
+    job->ok = TRUE;
+    job->pos = 0;
+    fpec_queue[fpec_prod++ % ARRAY_SIZE(fpec_queue)] = job;
+}
+
+/*
+ * Note that the CPU stalls on any Flash access while the FPEC is busy, and we
+ * execute from Flash: an erase still stops everything for 20-40ms. What we
+ * avoid is doing the erase and all the programming in one go.
+ */
+void fpec_process(void)
+{
+    struct fpec_job *job;
+    uint16_t *f;
+    const uint16_t *d;
+    unsigned int n;
+
+    if ((fpec_cons == fpec_prod) || (flash->sr & FLASH_SR_BSY))
+        return;
+
+    job = fpec_queue[fpec_cons % ARRAY_SIZE(fpec_queue)];
+
+    if (!job->erased) {
+        fpec_init();
+        flash->cr |= FLASH_CR_PER;
+        flash->ar = job->erase;
+        flash->cr |= FLASH_CR_STRT;
+        job->erased = TRUE;
+        return;
+    }
+
+    /* Check how the erase went, or unlock the FPEC if there was none. */
+    if (job->erase && (job->pos == 0))
+        job->ok = fpec_wait_ok();
+    else if (job->pos == 0)
+        fpec_init();
+
+    f = (uint16_t *)(job->addr + job->pos);
+    d = (const uint16_t *)((const uint8_t *)job->data + job->pos);
+    for (n = 0; job->ok && (n < FPEC_STEP) && (job->pos < job->size); n++) {
+        flash->cr |= FLASH_CR_PG;
+        *f++ = *d++;
+        job->ok = fpec_wait_ok();
+        job->pos += 2;
+    }
+
+    if (job->ok && (job->pos < job->size))
+        return;
+
+    fpec_cons++;
+    flash->cr |= FLASH_CR_LOCK;
+    (*job->done)(job, job->ok);
+}
+
+unsigned int fpec_progress(const struct fpec_job *job)
+{
+    /* Count the erase as half the job. */
+    unsigned int pc = job->erase ? 50 : 0;
+    if (!job->erased)
+        return 0;
+    return pc + (job->pos * (100 - pc)) / job->size;
+}
+
+uint32_t crc32(const void *buf, unsigned int len)
+{
+    crc->cr = CRC_CR_RESET;
+    return crc32_more(buf, len);
+}
+
+uint32_t crc32_more(const void *buf, unsigned int len)
+{
+    const uint32_t *p = buf;
+
+    for (; len != 0; len -= 4)
+        crc->dr = *p++;
+    return crc->dr;
+}
+
 void delay_ticks(unsigned int ticks)
 {
     unsigned int diff, cur, prev = stk->val;
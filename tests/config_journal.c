@@ -0,0 +1,317 @@
+/*
+ * config_journal.c
+ *
+ * Host test of the config journal in src/config.c: cut the power at every
+ * step of every save, and check that the last committed config survives.
+ *
+ * Flash is modelled in RAM at its real address, programmed one halfword at a
+ * time like the FPEC does it, and erased in two halves. Each halfword and
+ * each half-erase is a step at which power may be lost. After a cut the
+ * statics of config.c are reset, as by a reboot, and config_init() runs.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* The host C library: its headers clash with the firmware's. */
+void abort(void);
+void exit(int status);
+long write(int fd, const void *buf, size_t count);
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long off);
+#define PROT_RW       3
+#define MAP_ANON_PRIV 0x22
+#define MAP_FIXED     0x10
+
+/* Fail ASSERT()s on the host. */
+#undef illegal
+#define illegal() abort()
+
+#include "../src/config.c"
+
+#define NR_SAVES 60
+
+const char fw_ver[] = "test";
+bool_t display_mirror;
+
+int printk(const char *format, ...) { return 0; }
+
+static void report(const char *format, ...)
+{
+    char s[128];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+    write(1, s, strlen(s));
+}
+void display_set_row(unsigned int layer, unsigned int row,
+                     const char *text) {}
+void display_show(unsigned int layer, uint8_t timeout) {}
+void display_hide(unsigned int layer) {}
+time_t time_now(void) { return 0; }
+void hdLedOff(void) {}
+uint8_t getConfigButtons(void) { return 0; }
+uint8_t keyscan_to_ascii(uint8_t key) { return 0; }
+bool_t gpio_pins_connected(GPIO gpio1, unsigned int pin1,
+                           GPIO gpio2, unsigned int pin2) { return FALSE; }
+
+/* The STM32 CRC unit, as in scripts/fwcrc.py. */
+uint32_t crc32(const void *buf, unsigned int len)
+{
+    const uint32_t *p = buf;
+    uint32_t crc = 0xffffffff;
+    unsigned int i;
+
+    for (; len != 0; len -= 4) {
+        crc ^= *p++;
+        for (i = 0; i < 32; i++)
+            crc = (crc & (1u<<31)) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+static uint8_t *flash_mem;
+#define FLASH_SIZE (CONFIG_PAGES*FLASH_PAGE_SIZE)
+
+/* The pending job, and how many more steps it gets before power is lost
+ * (-1: never). */
+static struct fpec_job *fpec_job;
+static int fpec_steps;
+
+void fpec_submit(struct fpec_job *job)
+{
+    ASSERT(fpec_job == NULL);
+    job->erased = !job->erase;
+    job->ok = TRUE;
+    job->pos = 0;
+    fpec_job = job;
+}
+
+unsigned int fpec_progress(const struct fpec_job *job)
+{
+    return 0;
+}
+
+static bool_t fpec_step(void)
+{
+    if (fpec_steps == 0)
+        return FALSE;
+    if (fpec_steps > 0)
+        fpec_steps--;
+    return TRUE;
+}
+
+/* Run the pending jobs to completion, or until the power is cut. Returns
+ * the number of steps taken. */
+static unsigned int fpec_run(void)
+{
+    struct fpec_job *job;
+    uint16_t *f;
+    const uint16_t *d;
+    unsigned int half, steps = 0;
+
+    while ((job = fpec_job) != NULL) {
+        if (!job->erased) {
+            for (half = 0; half < 2; half++) {
+                if (!fpec_step())
+                    return steps;
+                steps++;
+                memset((void *)(job->erase + half*FLASH_PAGE_SIZE/2),
+                       0xff, FLASH_PAGE_SIZE/2);
+            }
+            job->erased = TRUE;
+        }
+        f = (uint16_t *)(job->addr + job->pos);
+        d = (const uint16_t *)((const uint8_t *)job->data + job->pos);
+        while (job->ok && (job->pos < job->size)) {
+            if (!fpec_step())
+                return steps;
+            steps++;
+            /* Only erased halfwords can be programmed (PGERR). */
+            if ((*f != 0xffff) && (*d != 0))
+                job->ok = FALSE;
+            else
+                *f = *d;
+            f++, d++;
+            job->pos += 2;
+        }
+        fpec_job = NULL;
+        (*job->done)(job, job->ok);
+    }
+
+    return steps;
+}
+
+/* Lose power: forget everything but the contents of Flash, and boot. */
+static void reboot(void)
+{
+    fpec_job = NULL;
+    journal_head = NULL;
+    journal_seq = 0;
+    save_at = NULL;
+    save_again = NULL;
+    save_busy = save_reboot = FALSE;
+    memset(&config, 0xaa, sizeof(config));
+    config_init();
+}
+
+static void make_config(struct config *conf, unsigned int n)
+{
+    *conf = dfl_config;
+    snprintf(conf->TOStitle[n%4], sizeof(conf->TOStitle[0]), "Save %u", n);
+    conf->tos = 1 + n%4;
+    conf->sound[n%4] = n & 1;
+    conf->boot[(n/4)%4] = (n/2) & 1;
+}
+
+static void check(const struct config *conf, const char *what,
+                  unsigned int n, unsigned int cut)
+{
+    if (memcmp(&config, conf, sizeof(config)) == 0)
+        return;
+    report("FAIL: save %u cut after %u steps: %s config not recovered\n",
+           n, cut, what);
+    exit(1);
+}
+
+/* Boot with the config of v1.9 in Flash: it must be read, and saved in the
+ * journal. */
+static void check_legacy(void)
+{
+    uint8_t *p = flash_mem + 3*FLASH_PAGE_SIZE;
+    struct config want = dfl_config;
+    uint16_t crc;
+
+    strcpy(want.TOStitle[1], "Legacy");
+    want.tos = 3;
+    memset(want.sound, 1, sizeof(want.sound));
+    memset(want.boot, 0, sizeof(want.boot));
+
+    memset(flash_mem, 0xff, FLASH_SIZE);
+    memcpy(p, want.TOStitle, sizeof(want.TOStitle));
+    p[4*17] = want.tos;
+    p[4*17+1] = want.sound[0];
+    p[4*17+2] = want.boot[0];
+    crc = crc16_ccitt(p, LEGACY_SIZE, 0xffff);
+    p[LEGACY_SIZE] = crc >> 8;
+    p[LEGACY_SIZE+1] = crc;
+
+    reboot();
+    if (memcmp(&config, &want, sizeof(config)) || (fpec_job == NULL)) {
+        report("FAIL: v1.9 config not migrated\n");
+        exit(1);
+    }
+    fpec_run();
+    reboot();
+    if (memcmp(&config, &want, sizeof(config)) || (journal_head == NULL)) {
+        report("FAIL: v1.9 config not saved in the journal\n");
+        exit(1);
+    }
+}
+
+/* Settings out of range for this firmware, e.g. saved by a newer one, boot
+ * with their defaults. */
+static void check_values(void)
+{
+    struct config_record *rec = (struct config_record *)save_buf;
+    struct config want = dfl_config;
+
+    strcpy(want.TOStitle[2], "Kept");
+    want.sound[0] = 1;
+
+    memset(flash_mem, 0xff, FLASH_SIZE);
+    reboot();
+    config = want;
+    config.sound[1] = 2;
+    config.sh1106 = 2;
+    config.tos = 0;
+    config.lcd_cols = 17;
+    config_save();
+    /* As saved by the next version: the record is not yet programmed. */
+    rec->version = CONFIG_VERSION + 1;
+    rec->crc32 = rec_crc(rec);
+    fpec_run();
+    reboot();
+    if (memcmp(&config, &want, sizeof(config))) {
+        report("FAIL: out-of-range settings not reset\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    static struct config want[NR_SAVES+1];
+    static uint8_t snap[FLASH_SIZE];
+    unsigned int n, cut, steps, cuts = 0;
+
+    flash_mem = mmap((void *)CONFIG_BASE, FLASH_SIZE, PROT_RW,
+                     MAP_ANON_PRIV|MAP_FIXED, -1, 0);
+    if (flash_mem != (uint8_t *)CONFIG_BASE) {
+        report("Cannot map Flash at %08x\n", CONFIG_BASE);
+        return 1;
+    }
+    memset(flash_mem, 0xff, FLASH_SIZE);
+
+    /* Blank Flash boots with the defaults. */
+    fpec_steps = -1;
+    reboot();
+    want[0] = dfl_config;
+    check(&want[0], "default", 0, 0);
+
+    for (n = 1; n <= NR_SAVES; n++) {
+        make_config(&want[n], n);
+        memcpy(snap, flash_mem, FLASH_SIZE);
+
+        /* The save uncut, to count its steps. */
+        config = want[n];
+        config_save();
+        steps = fpec_run();
+
+        for (cut = 0; cut <= steps; cut++) {
+            memcpy(flash_mem, snap, FLASH_SIZE);
+            reboot();
+            config = want[n];
+            fpec_steps = cut;
+            config_save();
+            fpec_run();
+            fpec_steps = -1;
+            reboot();
+            check((cut == steps) ? &want[n] : &want[n-1],
+                  (cut == steps) ? "new" : "old", n, cut);
+            /* Saving again must work whatever the cut left behind. */
+            config = want[n];
+            config_save();
+            fpec_run();
+            reboot();
+            check(&want[n], "resaved", n, cut);
+            cuts++;
+        }
+
+        /* Move on from a clean save of this config. */
+        memcpy(flash_mem, snap, FLASH_SIZE);
+        reboot();
+        config = want[n];
+        config_save();
+        fpec_run();
+        reboot();
+        check(&want[n], "new", n, steps);
+    }
+
+    check_legacy();
+    check_values();
+
+    report("config_journal: %u saves, %u power cuts, migration, checks: OK\n",
+           NR_SAVES, cuts);
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */
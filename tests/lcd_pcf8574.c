@@ -0,0 +1,372 @@
+/*
+ * lcd_pcf8574.c
+ *
+ * Host test of the HD44780 LCD driver in src/lcd.c, which drives the
+ * display's 4-bit bus through the outputs of a PCF8574 on I2C. The driver
+ * talks to a model I2C peripheral, in simulated time, and the bytes it sends
+ * are fed to a model of the HD44780.
+ *
+ * The driver skips setup bytes which are not needed. Its stream must decode
+ * to the same instructions, and leave the same DDRAM and CGRAM, as the stream
+ * with a setup byte before every nibble: and it must be shorter.
+ *
+ * The model latches RS and RW on the rising edge of EN, and D7-D4 on the
+ * falling edge. It fails the test if RS or RW change together with EN
+ * rising (address setup) or while EN is high, or if D7-D4 change together
+ * with EN falling (data hold). It also fails it if EN falls before the
+ * last instruction has been executed, as the driver never reads the busy
+ * flag.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * See the file COPYING for more details, or visit <http://unlicense.org>.
+ */
+
+/* The host C library: its headers clash with the firmware's. */
+void abort(void);
+void exit(int status);
+long write(int fd, const void *buf, size_t count);
+
+/* Fail ASSERT()s on the host. */
+#undef illegal
+#define illegal() abort()
+
+/* No interrupts on the host. */
+#undef IRQ_save
+#define IRQ_save(newpri) 0
+#undef IRQ_restore
+#define IRQ_restore(oldpri) ((void)(oldpri))
+
+/* The driver reads the SysTick in each of its bus waits: that is when the
+ * model I2C peripheral moves on. */
+static stk_time_t i2c_step(void);
+#undef stk_now
+#define stk_now() i2c_step()
+
+#include "../src/lcd.c"
+
+struct config config;
+
+int printk(const char *format, ...) { return 0; }
+void logk_record(const char *format, unsigned int nr,
+                 const uint32_t *args) {}
+void display_invalidate(void) {}
+void gpio_configure_pin(GPIO gpio, unsigned int pin, unsigned int mode) {}
+
+static void report(const char *format, ...)
+{
+    char s[128];
+    va_list ap;
+
+    va_start(ap, format);
+    vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+    write(1, s, strlen(s));
+}
+
+/*
+ * The I2C peripheral, and the PCF8574 at address 0x27. Each byte takes 9
+ * SCL clocks, and the PCF8574 outputs change as it is acknowledged.
+ */
+
+#define NO_DATA 0x100
+
+static struct i2c fake_i2c = {
+    .dr = NO_DATA,
+    .sr1 = I2C_SR1_TXE | I2C_SR1_BTF | I2C_SR1_ADDR | I2C_SR1_SB
+};
+
+static uint64_t now_ns;
+
+static struct {
+    uint8_t b[16384];
+    uint64_t ns[16384]; /* when the outputs changed */
+    unsigned int len;
+} pcf;
+
+static bool_t addressed;   /* the address byte has been sent */
+static bool_t setup_all;   /* force a setup byte before every nibble */
+
+void delay_us(unsigned int us)
+{
+    now_ns += us * 1000ull;
+}
+
+void delay_ms(unsigned int ms)
+{
+    now_ns += ms * 1000000ull;
+}
+
+static unsigned int scl_ns(void)
+{
+    return i2c_fast ? 2500 : 10000;
+}
+
+static stk_time_t i2c_step(void)
+{
+    if (fake_i2c.cr1 & I2C_CR1_START) {
+        fake_i2c.cr1 &= ~I2C_CR1_START;
+        now_ns += scl_ns();
+        addressed = FALSE;
+    }
+
+    if (fake_i2c.dr != NO_DATA) {
+        now_ns += 9 * scl_ns();
+        if (!addressed) {
+            if (fake_i2c.dr != (0x27 << 1)) {
+                report("FAIL: address byte %02x\n", fake_i2c.dr);
+                exit(1);
+            }
+            addressed = TRUE;
+        } else if (pcf.len < ARRAY_SIZE(pcf.b)) {
+            pcf.b[pcf.len] = fake_i2c.dr;
+            pcf.ns[pcf.len++] = now_ns;
+            if (setup_all)
+                pcf_last = 0xff;
+        } else {
+            report("FAIL: stream too long\n");
+            exit(1);
+        }
+        fake_i2c.dr = NO_DATA;
+    }
+
+    if (fake_i2c.cr1 & I2C_CR1_STOP) {
+        fake_i2c.cr1 &= ~I2C_CR1_STOP;
+        now_ns += scl_ns();
+    }
+
+    return -(stk_time_t)(now_ns * STK_MHZ / 1000) & STK_MASK;
+}
+
+/* Let the controller finish the last slow command (see lcd_command()). */
+static void wait_ready(void)
+{
+    while (!lcd_ready())
+        now_ns += 10000;
+}
+
+/* A session: init, a resync after a transaction is cut off after one
+ * nibble, glyphs, rows of a 20x4 panel, scrolling, backlight. */
+static void drive(void)
+{
+    static const uint8_t bar[8] = { 0x1f, 0x1f, 0, 0, 0, 0, 0x1f, 0x1f };
+    char rows[4][21] = {
+        "Atari STe Xtreme", "Current ROM 2:", "TOS 2.06 *",
+        "12345678901234567890"
+    };
+    unsigned int i, len;
+
+    memset(glyphs, 0, sizeof(glyphs));
+    lcd_exec.ticks = 0;
+    lcd_cols = 20;
+    lcd_rows = 4;
+    bl_on = _BL;
+    pcf.len = 0;
+    now_ns = 0;
+
+    lcd_controller_init();
+    lcd_begin();
+    write4(('X' & 0xf0) | bl_on | _RS);
+    i2c_stop();
+    lcd_controller_init();
+
+    for (i = 0; i < ARRAY_SIZE(rows); i++) {
+        len = strlen(rows[i]);
+        if (rows[i][len-1] == '*')
+            rows[i][len-1] = lcd_glyph(bar);
+        wait_ready();
+        lcd_refresh((uint8_t *)rows[i], i, len);
+    }
+    for (i = 0; i < 3; i++) {
+        wait_ready();
+        lcd_shift_left();
+    }
+    wait_ready();
+    lcd_shift_home();
+    wait_ready();
+    backlight(0);
+    lcd_refresh((uint8_t *)"Off", 1, 3);
+    backlight(1);
+    lcd_refresh((uint8_t *)"On", 1, 2);
+}
+
+/*
+ * The HD44780, from power on (8-bit interface).
+ */
+
+#define EXEC_NS       37000   /* most instructions */
+#define EXEC_DATA_NS  41000   /* write to DDRAM or CGRAM */
+#define EXEC_HOME_NS  1520000 /* Clear Display, Return Home */
+
+struct hd44780 {
+    uint8_t pins;       /* PCF8574 outputs */
+    uint8_t rs, rw;     /* latched as EN rose */
+    bool_t bus4, nibble; /* 4-bit interface; low nibble next */
+    uint8_t hi;
+    bool_t cgram;       /* address counter points into CGRAM */
+    uint8_t ac;
+    uint8_t ddram[128], cgram_mem[64];
+    uint16_t log[4096]; /* RS:8, byte:0-7 */
+    unsigned int nr_log;
+    int resets;         /* Function Sets since power on (-1: initialised) */
+    uint64_t exec_ns;   /* when the last instruction was latched */
+    uint32_t exec_len;  /* and how long it takes */
+};
+
+static const char *stream;
+
+static void lcd_fail(const char *what, unsigned int pos)
+{
+    report("FAIL: %s stream, byte %u: %s\n", stream, pos, what);
+    exit(1);
+}
+
+static void hd_execute(struct hd44780 *hd, uint8_t x)
+{
+    uint32_t len = EXEC_NS;
+
+    if (hd->nr_log < ARRAY_SIZE(hd->log))
+        hd->log[hd->nr_log++] = (hd->rs << 8) | x;
+
+    if (hd->rs) {
+        if (hd->cgram)
+            hd->cgram_mem[hd->ac++ & 0x3f] = x;
+        else
+            hd->ddram[hd->ac++ & 0x7f] = x;
+        len = EXEC_DATA_NS;
+    } else if (x & 0x80) {
+        hd->cgram = FALSE;
+        hd->ac = x & 0x7f;
+    } else if (x & 0x40) {
+        hd->cgram = TRUE;
+        hd->ac = x & 0x3f;
+    } else if (x & 0x20) {
+        hd->bus4 = !(x & 0x10);
+        hd->nibble = FALSE;
+        /* Initialising by instruction from power on. */
+        if (hd->resets == 0)
+            len = 4100000;
+        else if (hd->resets == 1)
+            len = 100000;
+        if (hd->resets >= 0)
+            hd->resets++;
+    } else if (x == 0x01) {
+        memset(hd->ddram, ' ', sizeof(hd->ddram));
+        hd->cgram = FALSE;
+        hd->ac = 0;
+        len = EXEC_HOME_NS;
+    } else if ((x & 0xfe) == 0x02) {
+        hd->cgram = FALSE;
+        hd->ac = 0;
+        len = EXEC_HOME_NS;
+    }
+
+    if (!(x & 0x20) || hd->rs)
+        hd->resets = -1;
+    hd->exec_len = len;
+}
+
+static void hd_feed(struct hd44780 *hd, unsigned int pos)
+{
+    uint8_t prev = hd->pins, b = pcf.b[pos];
+    uint64_t now = pcf.ns[pos];
+    char s[80];
+
+    hd->pins = b;
+    if (!(prev & _EN) && (b & _EN)) {
+        if ((prev ^ b) & (_RS|_RW))
+            lcd_fail("RS/RW change with EN rising", pos);
+        hd->rs = !!(b & _RS);
+        hd->rw = !!(b & _RW);
+    } else if ((prev & _EN) && (b & _EN)) {
+        if ((prev ^ b) & (_RS|_RW))
+            lcd_fail("RS/RW change while EN is high", pos);
+    } else if ((prev & _EN) && !(b & _EN)) {
+        if ((prev ^ b) & (_D7|_D6|_D5|_D4|_RS|_RW))
+            lcd_fail("D7-D4 change with EN falling", pos);
+        if (hd->rw)
+            lcd_fail("read cycle", pos);
+        if (now - hd->exec_ns < hd->exec_len) {
+            snprintf(s, sizeof(s), "EN falls %uus after instruction %02x, "
+                     "which takes %uus", (unsigned int)(now - hd->exec_ns)
+                     / 1000, hd->log[hd->nr_log-1] & 0xff,
+                     hd->exec_len / 1000);
+            lcd_fail(s, pos);
+        }
+        if (!hd->bus4) {
+            hd_execute(hd, prev & 0xf0);
+            hd->exec_ns = now;
+        } else if (!hd->nibble) {
+            hd->hi = prev & 0xf0;
+            hd->nibble = TRUE;
+        } else {
+            hd->nibble = FALSE;
+            hd_execute(hd, hd->hi | (prev >> 4));
+            hd->exec_ns = now;
+        }
+    }
+}
+
+static unsigned int run(struct hd44780 *hd, const char *name,
+                        bool_t fast, bool_t setup)
+{
+    unsigned int i;
+
+    stream = name;
+    i2c_fast = fast;
+    setup_all = setup;
+    drive();
+    memset(hd, 0, sizeof(*hd));
+    for (i = 0; i < pcf.len; i++)
+        hd_feed(hd, i);
+    return pcf.len;
+}
+
+static void compare(const struct hd44780 *old, const struct hd44780 *new,
+                    unsigned int len)
+{
+    if ((old->nr_log != new->nr_log)
+        || memcmp(old->log, new->log, old->nr_log * sizeof(old->log[0])))
+        lcd_fail("instructions differ from the old stream", len);
+    if (memcmp(old->ddram, new->ddram, sizeof(old->ddram))
+        || memcmp(old->cgram_mem, new->cgram_mem, sizeof(old->cgram_mem)))
+        lcd_fail("DDRAM/CGRAM differ from the old stream", len);
+}
+
+int main(int argc, char **argv)
+{
+    static struct hd44780 old, new, slow;
+    unsigned int old_len, new_len, slow_len;
+    uint64_t new_ns;
+
+    i2c = &fake_i2c;
+
+    old_len = run(&old, "old", TRUE, TRUE);
+    new_len = run(&new, "new", TRUE, FALSE);
+    new_ns = now_ns;
+    slow_len = run(&slow, "100kHz", FALSE, FALSE);
+
+    /* The model decodes the old stream as the driver meant it. */
+    if (!old.bus4 || memcmp(&old.ddram[0x40], "On", 2)
+        || memcmp(&old.ddram[0x54], "12345678901234567890", 20)
+        || (old.ddram[0x14 + 9] != 0) || (old.cgram_mem[0] != 0x1f))
+        lcd_fail("not decoded as sent", old_len);
+
+    compare(&old, &new, new_len);
+    compare(&old, &slow, slow_len);
+    if (new_len >= old_len)
+        lcd_fail("no shorter than the old stream", new_len);
+
+    report("lcd_pcf8574: %u instructions, %u bytes (was %u) in %uus: OK\n",
+           new.nr_log, new_len, old_len, (unsigned int)(new_ns / 1000));
+    return 0;
+}
+
+/*
+ * Local variables:
+ * mode: C
+ * c-file-style: "Linux"
+ * c-basic-offset: 4
+ * tab-width: 4
+ * indent-tabs-mode: nil
+ * End:
+ */